@@ -1,5 +1,11 @@
 #include "1035.h"
 #include <string.h>
+#include <stdlib.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 unsigned short int net2short(unsigned char **bufp)
 {
@@ -45,33 +51,112 @@ void long2net(unsigned long int l, unsigned char **bufp)
     *bufp += 4;
 }
 
+// names only fold ascii A-Z to a-z, anything else (utf8 too) has to be the same byte
+#define _ONES 0x0101010101010101ULL
+
+unsigned long long _fold8(unsigned long long w)
+{ // fold all 8 bytes at once, a byte is upper case if its low 7 bits are from A to Z and its high bit is clear
+    unsigned long long h = w & (_ONES * 0x7f);
+    unsigned long long upper = (h + _ONES * (0x80 - 'A')) & ~(h + _ONES * (0x80 - 'Z' - 1)) & ~w & (_ONES * 0x80);
+    return w | (upper >> 2);
+}
+
+// are the first len bytes of a and b the same, folded
+int _nsame(unsigned char *a, unsigned char *b, int len)
+{
+    unsigned long long x, y;
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i lo = _mm256_set1_epi8('A' - 1), hi = _mm256_set1_epi8('Z' + 1), bit = _mm256_set1_epi8(0x20), va, vb;
+    for(; i + 32 <= len; i += 32)
+    {
+        va = _mm256_loadu_si256((__m256i *)(a + i));
+        vb = _mm256_loadu_si256((__m256i *)(b + i));
+        va = _mm256_or_si256(va, _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi8(va, lo), _mm256_cmpgt_epi8(hi, va)), bit));
+        vb = _mm256_or_si256(vb, _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi8(vb, lo), _mm256_cmpgt_epi8(hi, vb)), bit));
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != -1) return 0;
+    }
+#elif defined(__SSE2__)
+    __m128i lo = _mm_set1_epi8('A' - 1), hi = _mm_set1_epi8('Z' + 1), bit = _mm_set1_epi8(0x20), va, vb;
+    for(; i + 16 <= len; i += 16)
+    { // signed compares, so bytes over 0x7f are never in range
+        va = _mm_loadu_si128((__m128i *)(a + i));
+        vb = _mm_loadu_si128((__m128i *)(b + i));
+        va = _mm_or_si128(va, _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi8(va, lo), _mm_cmpgt_epi8(hi, va)), bit));
+        vb = _mm_or_si128(vb, _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi8(vb, lo), _mm_cmpgt_epi8(hi, vb)), bit));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) return 0;
+    }
+#endif
+    for(; i + 8 <= len; i += 8)
+    {
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if(_fold8(x) != _fold8(y)) return 0;
+    }
+    if(i == len) return 1;
+    x = y = 0;
+    memcpy(&x, a + i, len - i);
+    memcpy(&y, b + i, len - i);
+    return _fold8(x) == _fold8(y);
+}
+
+int name_same(unsigned char *a, unsigned char *b)
+{
+    int len;
+    if(a == b) return 1;
+    if(a == 0 || b == 0) return 0;
+    len = strlen(a);
+    if(strlen(b) != len) return 0; // folding never changes the length
+    return _nsame(a, b, len);
+}
+
+unsigned long int name_hash(unsigned char *name)
+{ // folded 8 bytes at a time, mixed like 64bit fnv-1a but a word per round
+    unsigned long long w, h = 14695981039346656037ULL;
+    int i, len = strlen(name);
+    for(i = 0; i < len; i += 8)
+    {
+        w = 0;
+        memcpy(&w, name + i, len - i < 8 ? len - i : 8);
+        h = (h ^ _fold8(w)) * 1099511628211ULL;
+        h ^= h >> 32;
+    }
+    return (unsigned long int)h;
+}
+
 unsigned short int _ldecomp(unsigned char *ptr)
 {
     unsigned short int i;
     i = 0xc0 ^ ptr[0];
     i <<= 8;
     i |= ptr[1];
-    if(i >= 4096) i = 4095;
+    if(i >= MAX_PACKET_LEN - 1) i = MAX_PACKET_LEN - 2;
     return i;
 }
 
-void _label(struct message *m, unsigned char **bufp, unsigned char **namep)
+int _label(struct message *m, unsigned char **bufp, unsigned char **namep)
 {
     unsigned char *label, *name;
     int x;
 
-    // set namep to the end of the block
+    // set namep to the end of the block, needs at least room for the ending 0
+    if(m->_len >= MESSAGE_SPACE || (*bufp - m->_buf) + 2 > MAX_PACKET_LEN) return 0;
     *namep = name = m->_packet + m->_len;
 
     // loop storing label in the block
     for(label = *bufp; *label != 0; name += *label + 1, label += *label + 1)
     {
-        // skip past any compression pointers, kick out if end encountered (bad data prolly)
+        // skip past any compression pointers, only ever backwards so bad data can't loop, kick out if end encountered
         while(*label & 0xc0)
-            if(*(label = m->_buf + _ldecomp(label)) == 0) break;
+        {
+            if(m->_buf + _ldecomp(label) >= label) return 0;
+            label = m->_buf + _ldecomp(label);
+        }
+        if(*label == 0) break;
 
-        // make sure we're not over the limits
-        if((name + *label) - *namep > 255 || m->_len + ((name + *label) - *namep) > 4096) return;
+        // make sure we're not over the limits, the label (and what follows) has to be in the packet, room for it, its dot and the ending 0
+        if((label - m->_buf) + *label + 2 >= MAX_PACKET_LEN) return 0;
+        if((name + *label) - *namep > 255 || (name + *label + 2) - m->_packet > MESSAGE_SPACE) return 0;
 
         // copy chars for this label
         memcpy(name,label+1,*label);
@@ -88,47 +173,79 @@ void _label(struct message *m, unsigned char **bufp, unsigned char **namep)
     {
         if(strcmp(*namep,m->_labels[x])) continue;
         *namep = m->_labels[x];
-        return;
+        return 1;
     }
     // no cache, so cache it if room
     if(x <= 19 && m->_labels[x] == 0)
         m->_labels[x] = *namep;
     m->_len += (name - *namep) + 1;
+    return 1;
 }
 
-// internal label matching
-int _lmatch(struct message *m, unsigned char *l1, unsigned char *l2)
+// hash a label onto the hash of the suffix that follows it (fnv-1a)
+unsigned long int _lhash(unsigned char *label, unsigned long int h)
 {
     int len;
+    if(h == 0) h = 2166136261UL;
+    for(len = 0; len <= *label; len++)
+        h = ((h ^ label[len]) * 16777619UL) & 0xffffffffUL;
+    return h;
+}
 
-    // always ensure we get called w/o a pointer
-    if(*l1 & 0xc0) return _lmatch(m, m->_buf + _ldecomp(l1),l2);
-    if(*l2 & 0xc0) return _lmatch(m, l1, m->_buf + _ldecomp(l2));
-
-    // same already?
-    if(l1 == l2) return 1;
-
-    // compare all label characters
-    if(*l1 != *l2) return 0;
-    for(len = 1; len <= *l1; len++)
-        if(l1[len] != l2[len]) return 0;
-
-    // get new labels
-    l1 += *l1 + 1;
-    l2 += *l2 + 1;
+// does the suffix written at p in the packet (may end in a pointer) match the uncompressed labels at l
+int _lsame(struct message *m, unsigned char *p, unsigned char *l)
+{
+    int len;
+    while(1)
+    {
+        while((*p & 0xc0) == 0xc0) p = m->_packet + (((p[0] & 0x3f) << 8) | p[1]);
+        if(*p != *l) return 0;
+        if(*l == 0) return 1;
+        for(len = 1; len <= *l; len++)
+            if(p[len] != l[len]) return 0;
+        p += *p + 1;
+        l += *l + 1;
+    }
+}
 
-    // at the end, all matched
-    if(*l1 == 0 && *l2 == 0) return 1;
+// offset of a suffix already in the packet, or 0
+unsigned short int _dict_find(struct message *m, unsigned char *label, unsigned long int hash)
+{
+    int i = hash & (MESSAGE_DICT - 1);
+    for(; m->_dict[i].off; i = (i + 1) & (MESSAGE_DICT - 1))
+        if(m->_dict[i].tag == (unsigned short int)(hash >> 16) && _lsame(m, m->_packet + m->_dict[i].off, label))
+            return m->_dict[i].off;
+    return 0;
+}
 
-    // try next labels
-    return _lmatch(m,l1,l2);
+// remember where a suffix is so later names can point at it
+void _dict_add(struct message *m, unsigned short int off, unsigned long int hash)
+{
+    int i = hash & (MESSAGE_DICT - 1);
+    if(off > 0x3fff) return; // out of pointer range
+    while(m->_dict[i].off) i = (i + 1) & (MESSAGE_DICT - 1);
+    m->_dict[i].off = off;
+    m->_dict[i].tag = hash >> 16;
+    m->_dictused[m->_dictn++] = i;
 }
 
-// nasty, convert host into label using compression
-int _host(struct message *m, unsigned char **bufp, unsigned char *name)
+// the labels of a name, right after the hashes
+struct mname_struct
+{
+    unsigned short int len, count; // bytes of labels (with the ending 0), and how many labels
+    unsigned int hash[1]; // hash of the suffix starting at each label, the labels follow
+};
+#define _mlabel(n) ((unsigned char *)((n)->hash + (n)->count))
+// big enough for any name
+#define _MNAME_MAX (sizeof(struct mname_struct) + 128 * sizeof(unsigned int) + 256)
+typedef char _mname_max_fits[_MNAME_MAX <= MESSAGE_NAME_MAX ? 1 : -1]; // what 1035.h promises callers of message_name_buf()
+
+// nasty, convert host into uncompressed labels and hash each suffix, into n which must be _MNAME_MAX
+mname _mname(unsigned char *name, mname n)
 {
-    unsigned char label[256], *l;
-    int len = 0, x = 1, y = 0, last = 0;
+    unsigned char label[256];
+    unsigned long int h = 0;
+    int x = 1, y = 0, last = 0, start[128];
 
     if(name == 0) return 0;
 
@@ -148,54 +265,89 @@ int _host(struct message *m, unsigned char **bufp, unsigned char *name)
     }
     label[last] = x - (last + 1);
     if(x == 1) x--; // special case, bad names, but handle correctly
-    len = x + 1;
+    n->len = x + 1;
     label[x] = 0; // always terminate w/ a 0
 
-    // double-loop checking each label against all m->_labels for match
-    for(x = 0; label[x]; x += label[x] + 1)
-    {
-        for(y = 0; m->_labels[y]; y++)
-            if(_lmatch(m,label+x,m->_labels[y]))
-            {
-                // matching label, set up pointer
-                l = label + x;
-                short2net(m->_labels[y] - m->_packet, &l);
-                label[x] |= 0xc0;
-                len = x + 2;
-                break;
-            }
-        if(label[x] & 0xc0) break;
-    }
+    // hash every suffix, from the root up
+    for(n->count = 0, x = 0; label[x]; x += label[x] + 1) start[n->count++] = x;
+    for(y = n->count - 1; y >= 0; y--) n->hash[y] = h = _lhash(label + start[y], h);
+    memcpy(_mlabel(n), label, n->len);
+    return n;
+}
+
+mname message_name(unsigned char *name)
+{
+    unsigned int buf[_MNAME_MAX / sizeof(unsigned int) + 1];
+    mname n, ret;
+    if((n = _mname(name, (mname)buf)) == 0) return 0;
+    ret = (mname)malloc(message_name_len(n));
+    memcpy(ret, n, message_name_len(n));
+    return ret;
+}
+
+mname message_name_buf(unsigned char *name, void *buf)
+{
+    return _mname(name, (mname)buf);
+}
+
+int message_name_len(mname n)
+{
+    return sizeof(struct mname_struct) + n->count * sizeof(unsigned int) + n->len;
+}
+
+// splice an encoded name into the packet, compressing it against everything already there
+int _mhost(struct message *m, unsigned char **bufp, mname n)
+{
+    unsigned char *label, *l;
+    unsigned short int off = 0;
+    int len, x, y, start[128];
+
+    if(n == 0) return 0;
+    label = _mlabel(n);
+    len = n->len;
+    for(x = 0, y = 0; y < n->count; x += label[x] + 1) start[y++] = x;
+
+    // the longest suffix already in the packet gets replaced with a pointer to it
+    for(y = 0; y < n->count; y++)
+        if((off = _dict_find(m, label + start[y], n->hash[y])) != 0)
+        {
+            len = start[y] + 2;
+            break;
+        }
 
     // copy into buffer, point there now
-    memcpy(*bufp,label,len);
     l = *bufp;
-    *bufp += len;
-
-    // for each new label, store it's location for future compression
-    for(x = 0; l[x]; x += l[x] + 1)
+    if(off)
     {
-        if(l[x] & 0xc0) break;
-        if(m->_label + 1 >= 19) break;
-        m->_labels[m->_label++] = l + x;
+        memcpy(l, label, start[y]);
+        *bufp += start[y];
+        short2net(off | 0xc000, bufp);
+    }else{
+        memcpy(l, label, len);
+        *bufp += len;
     }
 
+    // each new suffix can be pointed to from now on
+    for(x = 0; x < y; x++)
+        _dict_add(m, (l + start[x]) - m->_packet, n->hash[x]);
+
     return len;
 }
 
-int _rrparse(struct message *m, struct resource *rr, int count, unsigned char **bufp)
+// on any error count is cut back to just the rrs that parsed
+int _rrparse(struct message *m, struct resource *rr, unsigned short int *count, unsigned char **bufp)
 {
     int i;
-    for(i=0; i < count; i++)
+    for(i=0; i < *count; i++)
     {
-        _label(m, bufp, &(rr[i].name));
+        if(!_label(m, bufp, &(rr[i].name)) || (*bufp - m->_buf) + 10 > MAX_PACKET_LEN) { *count = i; return 1; }
         rr[i].type = net2short(bufp);
         rr[i].class = net2short(bufp);
         rr[i].ttl = net2long(bufp);
         rr[i].rdlength = net2short(bufp);
 
         // if not going to overflow, make copy of source rdata
-        if(rr[i].rdlength + (*bufp - m->_buf) > MAX_PACKET_LEN || m->_len + rr[i].rdlength > MAX_PACKET_LEN) return 1;
+        if(rr[i].rdlength + (*bufp - m->_buf) > MAX_PACKET_LEN || m->_len + rr[i].rdlength > MESSAGE_SPACE) { *count = i; return 1; }
         rr[i].rdata = m->_packet + m->_len;
         m->_len += rr[i].rdlength;
         memcpy(rr[i].rdata,*bufp,rr[i].rdlength);
@@ -204,26 +356,27 @@ int _rrparse(struct message *m, struct resource *rr, int count, unsigned char **
         switch(rr[i].type)
         {
         case 1:
-            if(m->_len + 16 > MAX_PACKET_LEN) return 1;
+            if(m->_len + 16 > MESSAGE_SPACE || (*bufp - m->_buf) + 4 > MAX_PACKET_LEN) { *count = i; return 1; }
             rr[i].known.a.name = m->_packet + m->_len;
             m->_len += 16;
             sprintf(rr[i].known.a.name,"%d.%d.%d.%d",(*bufp)[0],(*bufp)[1],(*bufp)[2],(*bufp)[3]);
             rr[i].known.a.ip = net2long(bufp);
             break;
         case 2:
-            _label(m, bufp, &(rr[i].known.ns.name));
+            if(!_label(m, bufp, &(rr[i].known.ns.name))) { *count = i; return 1; }
             break;
         case 5:
-            _label(m, bufp, &(rr[i].known.cname.name));
+            if(!_label(m, bufp, &(rr[i].known.cname.name))) { *count = i; return 1; }
             break;
         case 12:
-            _label(m, bufp, &(rr[i].known.ptr.name));
+            if(!_label(m, bufp, &(rr[i].known.ptr.name))) { *count = i; return 1; }
             break;
         case 33:
+            if((*bufp - m->_buf) + 6 > MAX_PACKET_LEN) { *count = i; return 1; }
             rr[i].known.srv.priority = net2short(bufp);
             rr[i].known.srv.weight = net2short(bufp);
             rr[i].known.srv.port = net2short(bufp);
-            _label(m, bufp, &(rr[i].known.srv.name));
+            if(!_label(m, bufp, &(rr[i].known.srv.name))) { *count = i; return 1; }
             break;
         default:
             *bufp += rr[i].rdlength;
@@ -239,9 +392,10 @@ void message_parse(struct message *m, unsigned char *packet)
     int i;
 
     if(packet == 0 || m == 0) return;
+    message_reset(m);
 
     // keep all our mem in one (aligned) block for easy freeing
-    #define my(x,y) while(m->_len&7) m->_len++; (void*)x = (void*)(m->_packet + m->_len); m->_len += y;
+    #define my(x,y) while(m->_len&7) m->_len++; x = (void*)(m->_packet + m->_len); m->_len += y;
 
     // header stuff bit crap
     m->_buf = buf = packet;
@@ -256,19 +410,22 @@ void message_parse(struct message *m, unsigned char *packet)
     m->header.rcode = buf[1] & 0x0F;
     buf += 2;
     m->qdcount = net2short(&buf);
-    if(m->_len + (sizeof(struct question) * m->qdcount) > MAX_PACKET_LEN - 8) { m->qdcount = 0; return; }
     m->ancount = net2short(&buf);
-    if(m->_len + (sizeof(struct resource) * m->ancount) > MAX_PACKET_LEN - 8) { m->ancount = 0; return; }
     m->nscount = net2short(&buf);
-    if(m->_len + (sizeof(struct resource) * m->nscount) > MAX_PACKET_LEN - 8) { m->nscount = 0; return; }
     m->arcount = net2short(&buf);
-    if(m->_len + (sizeof(struct resource) * m->arcount) > MAX_PACKET_LEN - 8) { m->arcount = 0; return; }
+
+    // the arrays all go in first, if they can't all fit (with alignment) the counts are garbage
+    if(sizeof(struct question) * m->qdcount + sizeof(struct resource) * (m->ancount + m->nscount + m->arcount) > MESSAGE_SPACE - 32)
+    {
+        m->qdcount = m->ancount = m->nscount = m->arcount = 0;
+        return;
+    }
 
     // process questions
     my(m->qd, sizeof(struct question) * m->qdcount);
     for(i=0; i < m->qdcount; i++)
     {
-        _label(m, &buf, &(m->qd[i].name));
+        if(!_label(m, &buf, &(m->qd[i].name)) || (buf - m->_buf) + 4 > MAX_PACKET_LEN) { m->qdcount = i; m->ancount = m->nscount = m->arcount = 0; return; }
         m->qd[i].type = net2short(&buf);
         m->qd[i].class = net2short(&buf);
     }
@@ -277,78 +434,334 @@ void message_parse(struct message *m, unsigned char *packet)
     my(m->an, sizeof(struct resource) * m->ancount);
     my(m->ns, sizeof(struct resource) * m->nscount);
     my(m->ar, sizeof(struct resource) * m->arcount);
-    if(_rrparse(m,m->an,m->ancount,&buf)) return;
-    if(_rrparse(m,m->ns,m->nscount,&buf)) return;
-    if(_rrparse(m,m->ar,m->arcount,&buf)) return;
+    if(_rrparse(m,m->an,&m->ancount,&buf)) { m->nscount = m->arcount = 0; return; }
+    if(_rrparse(m,m->ns,&m->nscount,&buf)) { m->arcount = 0; return; }
+    _rrparse(m,m->ar,&m->arcount,&buf);
 }
 
-void message_qd(struct message *m, unsigned char *name, unsigned short int type, unsigned short int class)
+// skip over a name without decoding it, returns the offset just after it or 0 if it runs off the end
+int _vskip(struct mview *v, int off)
+{
+    while(off < v->_len)
+    {
+        if(v->_buf[off] == 0) return off + 1;
+        if((v->_buf[off] & 0xc0) == 0xc0) return (off + 2 <= v->_len) ? off + 2 : 0;
+        if(v->_buf[off] & 0xc0) return 0; // reserved label types
+        off += v->_buf[off] + 1;
+    }
+    return 0;
+}
+
+int message_view(struct mview *v, unsigned char *packet, int len)
+{
+    unsigned char *buf;
+    int i, count, off = 12;
+
+    if(packet == 0 || v == 0 || len < 12 || len > MAX_PACKET_LEN) return 0;
+
+    // header stuff, same as message_parse() but nothing else is touched
+    v->_buf = buf = packet;
+    v->_len = len;
+    v->id = net2short(&buf);
+    v->header.qr = (buf[0] & 0x80) >> 7;
+    v->header.opcode = (buf[0] & 0x78) >> 3;
+    v->header.aa = (buf[0] & 0x04) >> 2;
+    v->header.tc = (buf[0] & 0x02) >> 1;
+    v->header.rd = buf[0] & 0x01;
+    v->header.ra = (buf[1] & 0x80) >> 7;
+    v->header.z = (buf[1] & 0x70) >> 4;
+    v->header.rcode = buf[1] & 0x0F;
+    buf += 2;
+    v->qdcount = net2short(&buf);
+    v->ancount = net2short(&buf);
+    v->nscount = net2short(&buf);
+    v->arcount = net2short(&buf);
+
+    // every entry is at least 5 bytes, so bogus counts can't fit
+    count = v->qdcount + v->ancount + v->nscount + v->arcount;
+    if(count > MAX_PACKET_LEN / 5) return 0;
+
+    // just remember where each one starts, skipping names and rdata
+    for(i = 0; i < count; i++)
+    {
+        v->_off[i] = off;
+        if((off = _vskip(v, off)) == 0) return 0;
+        if(i < v->qdcount)
+        {
+            off += 4;
+        }else{
+            off += 10;
+            if(off > len) return 0;
+            off += (v->_buf[off - 2] << 8) | v->_buf[off - 1];
+        }
+        if(off > len) return 0;
+    }
+    return 1;
+}
+
+int mview_name(struct mview *v, int off, unsigned char *name)
+{
+    unsigned char *start = name;
+    int lim = off;
+
+    while(off < v->_len && v->_buf[off] != 0)
+    {
+        if((v->_buf[off] & 0xc0) == 0xc0)
+        { // pointers may only go backwards, each further back than the last, so no loops
+            if(off + 1 >= v->_len) return 0;
+            off = ((v->_buf[off] & 0x3f) << 8) | v->_buf[off + 1];
+            if(off >= lim) return 0;
+            lim = off;
+            continue;
+        }
+        if(v->_buf[off] & 0xc0 || off + v->_buf[off] >= v->_len || (name - start) + v->_buf[off] + 1 > 255) return 0;
+        memcpy(name, v->_buf + off + 1, v->_buf[off]);
+        name += v->_buf[off];
+        *name++ = '.';
+        off += v->_buf[off] + 1;
+    }
+    if(off >= v->_len) return 0;
+    *name = '\0';
+    return 1;
+}
+
+int mview_qd(struct mview *v, int i, struct question *q, unsigned char *buf)
+{
+    unsigned char *p;
+
+    if(i < 0 || i >= v->qdcount || !mview_name(v, v->_off[i], buf)) return 0;
+    q->name = buf;
+    p = v->_buf + _vskip(v, v->_off[i]);
+    q->type = net2short(&p);
+    q->class = net2short(&p);
+    return 1;
+}
+
+int mview_rr(struct mview *v, int i, struct resource *rr, unsigned char *buf)
+{
+    unsigned char *p;
+    int off;
+
+    if(i < 0 || i >= v->ancount + v->nscount + v->arcount) return 0;
+    i += v->qdcount;
+    if(!mview_name(v, v->_off[i], buf)) return 0;
+    rr->name = buf;
+    p = v->_buf + _vskip(v, v->_off[i]);
+    rr->type = net2short(&p);
+    rr->class = net2short(&p);
+    rr->ttl = net2long(&p);
+    rr->rdlength = net2short(&p);
+    rr->rdata = p;
+    off = p - v->_buf;
+
+    // decode commonly known ones, only the names need any space
+    bzero(&rr->known, sizeof(rr->known));
+    switch(rr->type)
+    {
+    case QTYPE_A:
+        if(rr->rdlength < 4) return 0;
+        rr->known.a.ip = net2long(&p);
+        break;
+    case QTYPE_NS:
+    case QTYPE_CNAME:
+    case QTYPE_PTR:
+        if(!mview_name(v, off, buf + 256)) return 0;
+        rr->known.ns.name = buf + 256;
+        break;
+    case QTYPE_SRV:
+        if(rr->rdlength < 7 || !mview_name(v, off + 6, buf + 256)) return 0;
+        rr->known.srv.priority = net2short(&p);
+        rr->known.srv.weight = net2short(&p);
+        rr->known.srv.port = net2short(&p);
+        rr->known.srv.name = buf + 256;
+        break;
+    }
+    return 1;
+}
+
+struct message *message_wire(void)
+{
+    struct message *m;
+    m = (struct message *)malloc(sizeof(struct message));
+    bzero(m, sizeof(struct message));
+    return m;
+}
+
+void message_reset(struct message *m)
+{
+    int len = m->_hwm;
+
+    // everything used since the last reset, whether built (_buf is in _packet) or parsed (it's the packet given)
+    //   m has to have been zero'd once (see 1035.h), nothing here can tell what was never cleared
+    if(m->_buf > m->_packet && m->_buf <= m->_packet + MESSAGE_SPACE && m->_buf - m->_packet > len) len = m->_buf - m->_packet;
+    if(m->_len > len) len = m->_len;
+    bzero(m->_packet, len);
+    m->_hwm = 0;
+
+    // only the dictionary slots that were filled
+    while(m->_dictn > 0) m->_dict[m->_dictused[--m->_dictn]].off = 0;
+
+    m->id = 0;
+    bzero(&m->header, sizeof(m->header));
+    m->qdcount = m->ancount = m->nscount = m->arcount = 0;
+    m->qd = 0;
+    m->an = m->ns = m->ar = 0;
+    m->_buf = 0;
+    bzero(m->_labels, sizeof(m->_labels));
+    m->_len = 0;
+    bzero(&m->_mark, sizeof(m->_mark));
+}
+
+void message_qd_enc(struct message *m, mname name, unsigned short int type, unsigned short int class)
 {
     m->qdcount++;
     if(m->_buf == 0) m->_buf = m->_packet + 12; // initialization
-    _host(m, &(m->_buf), name);
+    _mhost(m, &(m->_buf), name);
     short2net(type, &(m->_buf));
     short2net(class, &(m->_buf));
 }
 
-void _rrappend(struct message *m, unsigned char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+void message_qd(struct message *m, unsigned char *name, unsigned short int type, unsigned short int class)
+{
+    unsigned int buf[_MNAME_MAX / sizeof(unsigned int) + 1];
+    message_qd_enc(m, _mname(name, (mname)buf), type, class);
+}
+
+void _rrappend(struct message *m, mname name, unsigned short int type, unsigned short int class, unsigned long int ttl)
 {
     if(m->_buf == 0) m->_buf = m->_packet + 12; // initialization
-    _host(m, &(m->_buf), name);
+    _mhost(m, &(m->_buf), name);
     short2net(type, &(m->_buf));
     short2net(class, &(m->_buf));
     long2net(ttl, &(m->_buf));
 }
 
-void message_an(struct message *m, unsigned char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+void message_an_enc(struct message *m, mname name, unsigned short int type, unsigned short int class, unsigned long int ttl)
 {
     m->ancount++;
     _rrappend(m,name,type,class,ttl);
 }
 
-void message_ns(struct message *m, unsigned char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+void message_ns_enc(struct message *m, mname name, unsigned short int type, unsigned short int class, unsigned long int ttl)
 {
     m->nscount++;
     _rrappend(m,name,type,class,ttl);
 }
 
-void message_ar(struct message *m, unsigned char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+void message_ar_enc(struct message *m, mname name, unsigned short int type, unsigned short int class, unsigned long int ttl)
 {
     m->arcount++;
     _rrappend(m,name,type,class,ttl);
 }
 
+void message_an(struct message *m, unsigned char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+{
+    unsigned int buf[_MNAME_MAX / sizeof(unsigned int) + 1];
+    message_an_enc(m, _mname(name, (mname)buf), type, class, ttl);
+}
+
+void message_ns(struct message *m, unsigned char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+{
+    unsigned int buf[_MNAME_MAX / sizeof(unsigned int) + 1];
+    message_ns_enc(m, _mname(name, (mname)buf), type, class, ttl);
+}
+
+void message_ar(struct message *m, unsigned char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+{
+    unsigned int buf[_MNAME_MAX / sizeof(unsigned int) + 1];
+    message_ar_enc(m, _mname(name, (mname)buf), type, class, ttl);
+}
+
 void message_rdata_long(struct message *m, unsigned long int l)
 {
     short2net(4, &(m->_buf));
     long2net(l, &(m->_buf));
 }
 
-void message_rdata_name(struct message *m, unsigned char *name)
+void message_rdata_enc(struct message *m, mname name)
 {
     unsigned char *mybuf = m->_buf;
     m->_buf += 2;
-    short2net(_host(m, &(m->_buf), name),&mybuf); // hackish, but cute
+    short2net(_mhost(m, &(m->_buf), name),&mybuf); // hackish, but cute
 }
 
-void message_rdata_srv(struct message *m, unsigned short int priority, unsigned short int weight, unsigned short int port, unsigned char *name)
+void message_rdata_name(struct message *m, unsigned char *name)
+{
+    unsigned int buf[_MNAME_MAX / sizeof(unsigned int) + 1];
+    message_rdata_enc(m, _mname(name, (mname)buf));
+}
+
+void message_rdata_srv_enc(struct message *m, unsigned short int priority, unsigned short int weight, unsigned short int port, mname name)
 {
     unsigned char *mybuf = m->_buf;
     m->_buf += 2;
     short2net(priority, &(m->_buf));
     short2net(weight, &(m->_buf));
     short2net(port, &(m->_buf));
-    short2net(_host(m, &(m->_buf), name) + 6, &mybuf);
+    short2net(_mhost(m, &(m->_buf), name) + 6, &mybuf);
+}
+
+void message_rdata_srv(struct message *m, unsigned short int priority, unsigned short int weight, unsigned short int port, unsigned char *name)
+{
+    unsigned int buf[_MNAME_MAX / sizeof(unsigned int) + 1];
+    message_rdata_srv_enc(m, priority, weight, port, _mname(name, (mname)buf));
 }
 
 void message_rdata_raw(struct message *m, unsigned char *rdata, unsigned short int rdlength)
 {
-    if((m->_buf - m->_packet) + rdlength > 4096) rdlength = 0;
+    if((m->_buf - m->_packet) + 2 + rdlength > MAX_PACKET_LEN) rdlength = 0;
     short2net(rdlength, &(m->_buf));
     memcpy(m->_buf,rdata,rdlength);
     m->_buf += rdlength;
 }
 
+void message_mark(struct message *m)
+{
+    m->_mark.buf = m->_buf;
+    m->_mark.qdcount = m->qdcount;
+    m->_mark.ancount = m->ancount;
+    m->_mark.nscount = m->nscount;
+    m->_mark.arcount = m->arcount;
+    m->_mark.dictn = m->_dictn;
+}
+
+void message_rollback(struct message *m)
+{
+    if(m->_buf && m->_buf - m->_packet > m->_hwm) m->_hwm = m->_buf - m->_packet;
+
+    // undo the dictionary newest first, which leaves it exactly as it was
+    while(m->_dictn > m->_mark.dictn) m->_dict[m->_dictused[--m->_dictn]].off = 0;
+
+    m->_buf = m->_mark.buf;
+    m->qdcount = m->_mark.qdcount;
+    m->ancount = m->_mark.ancount;
+    m->nscount = m->_mark.nscount;
+    m->arcount = m->_mark.arcount;
+}
+
+void message_load(struct message *m, unsigned char *packet, int len)
+{
+    unsigned char *buf = packet;
+    if(len < 12 || len > MAX_PACKET_LEN) return;
+    memcpy(m->_packet, packet, len);
+    m->_buf = m->_packet + len;
+    m->id = net2short(&buf);
+    m->header.qr = (buf[0] & 0x80) >> 7;
+    m->header.opcode = (buf[0] & 0x78) >> 3;
+    m->header.aa = (buf[0] & 0x04) >> 2;
+    m->header.tc = (buf[0] & 0x02) >> 1;
+    m->header.rd = buf[0] & 0x01;
+    m->header.ra = (buf[1] & 0x80) >> 7;
+    m->header.z = (buf[1] & 0x70) >> 4;
+    m->header.rcode = buf[1] & 0x0F;
+    buf += 2;
+    m->qdcount = net2short(&buf);
+    m->ancount = net2short(&buf);
+    m->nscount = net2short(&buf);
+    m->arcount = net2short(&buf);
+    m->_packet[2] = m->_packet[3] = 0; // message_packet() ors the flags back in
+}
+
 unsigned char *message_packet(struct message *m)
 {
     unsigned char c, *buf = m->_buf;
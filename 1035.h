@@ -2,11 +2,18 @@
 #define _1035_h
 
 // be familiar with rfc1035 if you want to know what all the variable names mean, but this hides most of the dirty work
-// all of this code depends on the buffer space a packet is in being 4096 and zero'd before the packet is copied in
+// all of this code depends on the buffer space a packet is in being MAX_PACKET_LEN and zero'd before the packet is copied in
+// a message only has to be zero'd once (or come from message_wire()), after that message_reset() only clears what was used
 // also conveniently decodes srv rr's, type 33, see rfc2782
 
-// should be reasonably large, for udp
-#define MAX_PACKET_LEN 4000
+// the largest mdns message (rfc6762 section 17, jumbo frames), each mdnsd still builds to its own frame size
+#define MAX_PACKET_LEN 9000
+
+// room a parsed message has for the arrays, names and rdata it decodes to, whatever doesn't fit is cut off
+#define MESSAGE_SPACE (MAX_PACKET_LEN * 8)
+
+// slots in the name compression dictionary, a power of 2 with room for every label a MAX_PACKET_LEN packet can hold
+#define MESSAGE_DICT 8192
 
 struct question
 {
@@ -18,7 +25,9 @@ struct question
 #define QTYPE_NS 2
 #define QTYPE_CNAME 5
 #define QTYPE_PTR 12
+#define QTYPE_TXT 16
 #define QTYPE_SRV 33
+#define QTYPE_NSEC 47
 
 struct resource
 {
@@ -47,12 +56,37 @@ struct message
 
     // internal variables
     unsigned char *_buf, *_labels[20];
-    int _len, _label;
+    int _len, _hwm;
+
+    // compression dictionary when building, where each name suffix is in the packet keyed by its hash
+    struct { unsigned short int off, tag; } _dict[MESSAGE_DICT];
+    unsigned short int _dictused[MESSAGE_DICT], _dictn; // which slots are filled, so a reset only clears those
+
+    // where the message ended at message_mark()
+    struct { unsigned char *buf; unsigned short int qdcount, ancount, nscount, arcount, dictn; } _mark;
 
-    // packet acts as padding, easier mem management
-    unsigned char _packet[MAX_PACKET_LEN];
+    // packet acts as padding, easier mem management (built ones never go past MAX_PACKET_LEN)
+    unsigned char _packet[MESSAGE_SPACE];
 };
 
+// zero-copy view of a packet, nothing is copied and names/rdata are only decoded when asked for
+// the packet stays in the caller's buffer and must not be changed while the view is in use
+struct mview
+{
+    // external data
+    unsigned short int id;
+    struct { unsigned short qr:1, opcode:4, aa:1, tc:1, rd:1, ra:1, z:3, rcode:4; } header;
+    unsigned short int qdcount, ancount, nscount, arcount;
+
+    // internal variables, the packet and the offset of each question then each rr in it
+    unsigned char *_buf;
+    int _len;
+    unsigned short int _off[MAX_PACKET_LEN / 5];
+};
+
+// a name encoded once into labels (see message_name()), so it can be appended repeatedly without re-encoding
+typedef struct mname_struct *mname;
+
 // returns the next short/long off the buffer (and advances it)
 unsigned short int net2short(unsigned char **buf);
 unsigned long int net2long(unsigned char **buf);
@@ -61,12 +95,43 @@ unsigned long int net2long(unsigned char **buf);
 void short2net(unsigned short int i, unsigned char **buf);
 void long2net(unsigned long int l, unsigned char **buf);
 
-// parse packet into message, packet must be at least MAX_PACKET_LEN and message must be zero'd for safety
+// names are case-insensitive (ascii A-Z only), compare and hash them like that
+int name_same(unsigned char *a, unsigned char *b);
+unsigned long int name_hash(unsigned char *name);
+
+// parse packet into message, packet must be at least MAX_PACKET_LEN and zero padded, message is reset first
 void message_parse(struct message *m, unsigned char *packet);
 
-// create a message for sending out on the wire
+// scan a packet of len bytes into a view, only the header is read and each name skipped, returns 0 if it's malformed
+int message_view(struct mview *v, unsigned char *packet, int len);
+
+// decode the name at offset off of the packet into name (at least 256 bytes), returns 0 if it's malformed
+int mview_name(struct mview *v, int off, unsigned char *name);
+
+// decode the i'th question, buf holds the name (at least 256 bytes), returns 0 if it's malformed
+int mview_qd(struct mview *v, int i, struct question *q, unsigned char *buf);
+
+// decode the i'th rr (an, then ns, then ar, all numbered in order), buf holds the names (at least 512 bytes)
+//   rdata points straight into the packet, and known.a.name is not generated
+int mview_rr(struct mview *v, int i, struct resource *rr, unsigned char *buf);
+
+// create a message for sending out on the wire (zero'd), just free() it when done
 struct message *message_wire(void);
 
+// get a message ready to be parsed into or built again, only clears the header and the part of the packet used last time
+//   so m must have been zero'd once (see above), a never zero'd one isn't caught
+void message_reset(struct message *m);
+
+// encode a name into uncompressed labels and the hash of each suffix, returns 0 if it's too long, just free() it when done
+mname message_name(unsigned char *name);
+
+// same, but into buf, which has to be MESSAGE_NAME_MAX bytes (unsigned int aligned), for callers with their own memory to copy it to
+#define MESSAGE_NAME_MAX 1024
+mname message_name_buf(unsigned char *name, void *buf);
+
+// how many bytes an encoded name takes, it can be memcpy()'d that far into memory from anywhere else
+int message_name_len(mname n);
+
 // append a question to the wire message
 void message_qd(struct message *m, unsigned char *name, unsigned short int type, unsigned short int class);
 
@@ -81,6 +146,21 @@ void message_rdata_name(struct message *m, unsigned char *name);
 void message_rdata_srv(struct message *m, unsigned short int priority, unsigned short int weight, unsigned short int port, unsigned char *name);
 void message_rdata_raw(struct message *m, unsigned char *rdata, unsigned short int rdlength);
 
+// same as above, but with names from message_name(), the labels are just copied in and compressed
+void message_qd_enc(struct message *m, mname name, unsigned short int type, unsigned short int class);
+void message_an_enc(struct message *m, mname name, unsigned short int type, unsigned short int class, unsigned long int ttl);
+void message_ns_enc(struct message *m, mname name, unsigned short int type, unsigned short int class, unsigned long int ttl);
+void message_ar_enc(struct message *m, mname name, unsigned short int type, unsigned short int class, unsigned long int ttl);
+void message_rdata_enc(struct message *m, mname name);
+void message_rdata_srv_enc(struct message *m, unsigned short int priority, unsigned short int weight, unsigned short int port, mname name);
+
+// load an already built packet (len bytes) into a zero'd wire message, to send it again as-is
+void message_load(struct message *m, unsigned char *packet, int len);
+
+// remember where the message ends now, message_rollback() drops everything appended after that (try appending, check the length)
+void message_mark(struct message *m);
+void message_rollback(struct message *m);
+
 // return the wire format (and length) of the message, just free message when done
 unsigned char *message_packet(struct message *m);
 int message_packet_len(struct message *m);
@@ -1,12 +1,46 @@
 #include "mdnsd.h"
 #include <string.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 
 // size of query/publish hashes
-#define SPRIME 108
-// size of cache hash
-#define LPRIME 1009
-// brute force garbage cleanup frequency, rarely needed (daily default)
-#define GC 86400
+#define SPRIME 109
+// default number of name/types the cache index starts with room for, and how many slots move along per insert while it grows
+#define CACHE 1024
+#define REHASH 8
+// longest between asking a continuous query again, the interval doubles up to it from 1 sec (rfc6762 section 5.2)
+#define BACKOFF 3600
+// how long (msec) a resolve that timed out fails right away after, by default
+#define NEGATIVE 1000
+// longest mdnsd_sleep() when there's nothing at all to wait for
+#define IDLE 86400
+// how many threads can be in mdnsd_lookup() at once, more wait for a turn
+#define READERS 64
+// most additional records added to one answer packet
+#define EXTRA 32
+// buckets for the cache's per-type lists
+#define TYPES 61
+// starting size of the cache expiry heaps, doubled as needed
+#define HEAP 64
+// how many whole responses to hot questions are kept, and the most questions/records each can cover
+#define RCACHE 16
+#define RCQ 4
+#define RCR 16
+// cache snapshot file, starts with the magic and version (then how many entries), each entry is a fixed header then its names and rdata
+#define SNAPSHOT 0x6d646e73
+#define SNAPVERSION 1
+#define SNAPHEAD 12
+#define SNAPENTRY 32
+// starting size of the name atom table, doubled as needed
+#define ATOMS 64
+// nodes carved out of each slab by the pools, and the most rdata a cached entry or record keeps inline
+#define SLAB 64
+#define SMALL 32
 
 /* messy, but it's the best/simplest balance I can find at the moment
 Some internal data types, and a few hashes: querys, answers, cached, and records (published, unique and shared)
@@ -15,17 +49,98 @@ They inter-relate too, like records affect the querys they are relevant to
 Nice things about MDNS: we only publish once (and then ask asked), and only query once, then just expire records we've got cached
 */
 
+struct atom
+{ // one per distinct name (compared case-insensitively), shared by everything using it and freed with its last reference
+    unsigned long int hash;
+    int refs;
+    struct atom *next;
+    struct cached *owned; // cached entries with this name (what mdnsd_lookup() walks)
+    struct cached *targets; // cached entries with this as their rdname
+    struct atom *up, *kids, *knext, *kprev; // cached names by domain, up is the rest of the name after its first label
+    struct mdnsdw_struct *watches; // watching this domain
+    unsigned long int epoch; // when it was retired
+    struct atom *limbo;
+    char name[1];
+};
+
+// names in the cache, queries and records are all atoms, this gets back to the atom from one
+#define ATOM(s) ((struct atom *)((char *)(s) - offsetof(struct atom, name)))
+
 struct query
 {
     char *name;
     int type;
-    unsigned long int nexttry;
-    int tries;
-    int (*answer)(mdnsda, void *);
-    void *arg;
+    struct timeval nexttry, ask; // when it next needs a look (the sooner of ask and any of its answers' refresh), and asks anyway
+    int interval; // what ask moves on by next time, doubling
+    int heap; // where it is in the query heap
+    int known; // known answers still owed after it was asked, 1 + how many of them went already (it's on d->asked)
+    int busy; // answers being given out, unsubscribing then only marks them (until _q_sweep())
+    struct mdnsds_struct *subs, *own; // everyone subscribed, and the one mdnsd_query() manages
     struct query *next, *list;
 };
 
+struct mdnsds_struct
+{
+    struct query *q;
+    int (*answer)(mdnsda, void *); // 0 once it's unsubscribed
+    void *arg;
+    struct mdnsds_struct *next;
+};
+
+struct instance
+{ // a browsed instance and the subscriptions that follow it, i has the atoms and its own copy of the TXT
+    struct mdnsdi_struct i;
+    struct mdnsdb_struct *b;
+    mdnsds srv, txt, a;
+    int have; // which of SRV (1), TXT (2) are in i
+    int resolved; // last told as resolved
+    int txtsize;
+    struct instance *next;
+};
+
+struct mdnsdb_struct
+{
+    mdnsd d;
+    mdnsds ptr;
+    char *service;
+    int (*found)(mdnsdi, int, void *); // 0 once it's done
+    void *arg;
+    int busy; // in one of its callbacks, it's only freed after
+    struct instance *list;
+    struct mdnsdb_struct *next;
+};
+
+struct mdnsdw_struct
+{
+    char *domain;
+    int type;
+    int (*answer)(mdnsda, void *); // 0 once it's stopped
+    void *arg;
+    struct mdnsdw_struct *next, *all, *dead; // on its domain's list, on d->watches, and on d->wdead once stopped in a callback
+};
+
+struct mdnsdq_struct
+{
+    mdnsd d;
+    char *name;
+    int type;
+    struct timeval deadline;
+    void (*done)(mdnsda, void *); // 0 once it's done
+    void *arg;
+    mdnsds s;
+    mdnsdw nsec; // watching for an NSEC saying there's no such record
+    int busy; // still being set up, it's only freed after
+    struct mdnsdq_struct *next;
+};
+
+struct negative
+{ // a name/type a resolve timed out on, until when it fails right away
+    char *name;
+    int type;
+    struct timeval until;
+    struct negative *next, *after; // in its hash slot, and the one after it to expire
+};
+
 struct unicast
 {
     int id;
@@ -39,91 +154,503 @@ struct cached
 {
     struct mdnsda_struct rr;
     struct query *q;
-    struct cached *next;
+    int heap; // where it is in the expiry heap
+    unsigned long int rhash, at; // hash of the rdata (see _rhash()), and when it was last heard (when it was retired, once it is)
+    unsigned long int life, refresh; // the ttl it came with, and when its query should ask again to keep it (0 once it's past 95%)
+    int rstep; // which of the refresh points is next
+    struct cached *next; // (the limbo list, once it's retired)
+    struct cached *onext; // others in its name's atom
+    struct cached *tnext, *tprev; // others in its type's bucket
+    struct cached *rnext, *rprev; // others with the same rdname
+    unsigned char small[SMALL]; // rr.rdata when it fits
 };
 
+struct cslot
+{ // one per distinct name/type in the cache, all of its entries chained off of it
+    char *name; // atom, 0 when the slot was never used and TOMB when it was emptied
+    int type;
+    struct cached *list;
+};
+
+struct cindex
+{ // open addressing on the name's hash, so all types of a name are in the same run
+    struct cslot *slots;
+    int size, used, tombs; // size is a power of 2
+};
+
+static char _tomb;
+#define TOMB (&_tomb)
+
 struct mdnsdr_struct
 {
     struct mdnsda_struct rr;
     char unique; // # of checks performed to ensure
     int tries;
+    mname wname, wrdname; // rr.name and rr.rdname already in wire labels, redone only when they change
+    unsigned long int known; // when someone last listed it as a known answer, it's not added as an additional record for a second
+    unsigned long int wanted; // when a query last came in whose answers need it and didn't list it, no one's known answers hold it back then
     void (*conflict)(char *, int, void *);
     void *arg;
     struct mdnsdr_struct *next, *list;
+    unsigned char small[SMALL]; // rr.rdata when it fits
+};
+
+struct response
+{ // a finished answer packet for a set of questions, reused until any record in it changes
+    unsigned long int key;
+    int qdcount, count;
+    struct { char *name; int type; } qd[RCQ]; // names are atoms
+    mdnsdr r[RCR];
+    mdnsdr x[EXTRA]; // and the additional records in it
+    int xcount;
+    unsigned char *packet;
+    int len;
+    char pending, shared;
+    struct timeval at;
+    struct response *next, *list;
+};
+
+struct truncated
+{ // a TC query from someone, the answers to it held until the rest of their known answers come in
+    unsigned long int ip;
+    unsigned short int port;
+    struct timeval at;
+    int count, size;
+    mdnsdr *r;
+    struct truncated *next;
+};
+
+struct heap
+{ // cached entries, a min-heap on when each expires (rr.ttl)
+    struct cached **e;
+    int count, size;
+};
+
+struct retired
+{ // an old table readers might still be in, freed once they can't be
+    void *ptr;
+    unsigned long int epoch;
+    struct retired *next;
+};
+
+struct pool
+{ // fixed size nodes carved out of slabs, freed ones are kept on a list and handed out again
+    int size;
+    void *free, *slabs; // both linked through their first pointer
 };
 
 struct mdnsd_struct
 {
     char shutdown;
-    unsigned long int expireall, checkqlist;
+    unsigned int seed; // for jitter
     struct timeval now, sleep, pause, probe, publish;
     int class, frame;
-    struct cached *cache[LPRIME];
+    struct cindex cache, cold; // cold is the old index while it's being moved into cache a few slots at a time
+    int cmove;
+    struct cached *types[TYPES]; // every cached entry again, by type
+    struct heap heap[2]; // every cached entry, [1] has the ones a query is attached to, [0] the rest
+    int cachemax; // limits on the cache, 0 for none
+    unsigned long int cachebytes, cbytes; // and what it's using now
     struct mdnsdr_struct *published[SPRIME], *probing, *a_now, *a_pause, *a_publish;
     struct unicast *uanswers;
-    struct query *queries[SPRIME], *qlist;
+    struct query *queries[SPRIME], *asked;
+    struct query **qheap; // every query, a min-heap on nexttry
+    struct mdnsdb_struct *browses;
+    struct mdnsdw_struct *watches, *wdead;
+    int wbusy; // in watch callbacks, stopped ones are only freed after
+    struct mdnsdq_struct *resolves; // soonest deadline first
+    struct negative *negatives[SPRIME], *nfirst, *nlast; // and by when they expire, all as long so it's in order
+    int negative;
+    int qcount, qsize;
+    struct response *responses, *rsend;
+    int rcount;
+    struct truncated *truncated;
+    char spill; // known answers didn't all fit in the last query, continue them first
+    struct atom **atoms;
+    int natoms, atomsize;
+    char **known; // scratch, the atoms of each incoming known answer's name and rdname
+    int knownsize;
+    mdnsdr *sent; // scratch, the records answered in the packet mdnsd_out() is building
+    int nsent, sentsize;
+    struct message *in, *out; // scratch for parsing and building internally, only ever reset
+    void *(*alloc)(void *arg, unsigned long int size); // the caller's allocator, 0 for malloc()/free()
+    void (*free)(void *arg, void *ptr);
+    void *arg;
+    struct pool pcached, pquery, psub, punicast, precord;
+    // readers (mdnsd_lookup()) can be in the atoms and cache from other threads, so anything they could reach is retired at
+    // the current epoch instead of freed, and freed only once every reader still in there came in after that
+    unsigned long int epoch, aseq; // aseq is odd while the atom table is being regrown
+    struct { unsigned long int epoch; char pad[64 - sizeof(unsigned long int)]; } readers[READERS]; // each is 0 when free
+    unsigned int rturn;
+    struct cached *lcached;
+    struct atom *latoms;
+    struct retired *ltables;
 };
 
-int _namehash(const char *s)
+void *_d_alloc(mdnsd d, unsigned long int size)
+{ // all of our memory comes from here
+    if(d->alloc) return d->alloc(d->arg,size);
+    return malloc(size);
+}
+
+void _d_free(mdnsd d, void *ptr)
+{
+    if(ptr == 0) return;
+    if(d->alloc) d->free(d->arg,ptr);
+    else free(ptr);
+}
+
+void *_d_grow(mdnsd d, void *ptr, unsigned long int old, unsigned long int size)
+{ // realloc() by hand, the caller's allocator might not have one
+    void *n = _d_alloc(d,size);
+    if(old) memcpy(n,ptr,old);
+    _d_free(d,ptr);
+    return n;
+}
+
+void _p_init(struct pool *p, int size)
+{ // nodes are rounded up so each one in a slab stays pointer aligned
+    p->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    p->free = p->slabs = 0;
+}
+
+// a zero'd node from the pool, carving up another slab when it's out
+void *_p_get(mdnsd d, struct pool *p)
+{
+    char *slab;
+    void *node;
+    int i;
+    if(p->free == 0)
+    {
+        slab = (char *)_d_alloc(d, sizeof(void *) + p->size * SLAB);
+        *(void **)slab = p->slabs;
+        p->slabs = slab;
+        for(i = SLAB - 1; i >= 0; i--)
+        {
+            node = slab + sizeof(void *) + p->size * i;
+            *(void **)node = p->free;
+            p->free = node;
+        }
+    }
+    node = p->free;
+    p->free = *(void **)node;
+    bzero(node,p->size);
+    return node;
+}
+
+void _p_put(struct pool *p, void *node)
+{ // slabs are only given back by mdnsd_free()
+    *(void **)node = p->free;
+    p->free = node;
+}
+
+void _p_free(mdnsd d, struct pool *p)
+{
+    void *next;
+    for(; p->slabs != 0; p->slabs = next)
+    {
+        next = *(void **)p->slabs;
+        _d_free(d,p->slabs);
+    }
+    p->free = 0;
+}
+
+// room for len bytes of rdata, small (the node's own) if it fits
+unsigned char *_rdata(mdnsd d, unsigned char *small, int len)
+{
+    if(len <= SMALL) return small;
+    return (unsigned char *)_d_alloc(d,len);
+}
+
+void _rdata_free(mdnsd d, unsigned char *small, unsigned char *rdata)
+{
+    if(rdata != small) _d_free(d,rdata);
+}
+
+mname _wname(mdnsd d, char *name)
+{ // encoded on the stack, then copied into our own memory
+    unsigned int buf[MESSAGE_NAME_MAX / sizeof(unsigned int)];
+    mname n, ret;
+    if((n = message_name_buf(name,buf)) == 0) return 0;
+    ret = (mname)_d_alloc(d,message_name_len(n));
+    memcpy(ret,n,message_name_len(n));
+    return ret;
+}
+
+void _e_table(mdnsd d, void *ptr)
+{ // an old table, freed once no reader can be in it
+    struct retired *t = (struct retired *)_d_alloc(d,sizeof(struct retired));
+    t->ptr = ptr;
+    t->epoch = d->epoch;
+    t->next = d->ltables;
+    d->ltables = t;
+}
+
+int _e_enter(mdnsd d)
+{ // take a reader slot at the current epoch, retrying if it moved on meanwhile so the writer can't have missed us
+    unsigned long int e, cur;
+    int i = __atomic_fetch_add(&d->rturn, 1, __ATOMIC_RELAXED) % READERS;
+    for(;; i = (i + 1) % READERS)
+    {
+        cur = 0;
+        e = __atomic_load_n(&d->epoch, __ATOMIC_SEQ_CST);
+        if(__atomic_compare_exchange_n(&d->readers[i].epoch, &cur, e, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) break;
+    }
+    while((cur = __atomic_load_n(&d->epoch, __ATOMIC_SEQ_CST)) != e)
+        __atomic_store_n(&d->readers[i].epoch, e = cur, __ATOMIC_SEQ_CST);
+    return i;
+}
+
+void _e_exit(mdnsd d, int i)
+{
+    __atomic_store_n(&d->readers[i].epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+char *_atom_find(mdnsd d, char *name)
+{
+    struct atom *a;
+    unsigned long int hash;
+    if(name == 0) return 0;
+    hash = name_hash(name);
+    for(a = d->atoms[hash & (d->atomsize - 1)]; a != 0; a = a->next)
+        if(a->hash == hash && name_same(a->name, name))
+            return a->name;
+    return 0;
+}
+
+// the atom for name with another reference to it, made if it's new
+char *_atom(mdnsd d, char *name)
+{
+    struct atom *a, *next, **atoms;
+    unsigned long int hash;
+    int i, size;
+
+    if(name == 0) return 0;
+    hash = name_hash(name);
+    for(a = d->atoms[hash & (d->atomsize - 1)]; a != 0; a = a->next)
+        if(a->hash == hash && name_same(a->name, name))
+        {
+            a->refs++;
+            return a->name;
+        }
+
+    if(d->natoms >= d->atomsize)
+    { // grow, the hashes are kept so it's only relinking, readers go around again if they were in it meanwhile
+        size = d->atomsize * 2;
+        atoms = (struct atom **)_d_alloc(d,sizeof(struct atom *) * size);
+        bzero(atoms, sizeof(struct atom *) * size);
+        __atomic_store_n(&d->aseq, d->aseq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        for(i = 0; i < d->atomsize; i++)
+            for(a = d->atoms[i]; a != 0; a = next)
+            {
+                next = a->next;
+                __atomic_store_n(&a->next, atoms[a->hash & (size - 1)], __ATOMIC_RELAXED);
+                atoms[a->hash & (size - 1)] = a;
+            }
+        _e_table(d,d->atoms);
+        __atomic_store_n(&d->atoms, atoms, __ATOMIC_RELEASE); // before the size, so a reader never indexes the old one past its end
+        __atomic_store_n(&d->atomsize, size, __ATOMIC_RELEASE);
+        __atomic_store_n(&d->aseq, d->aseq + 1, __ATOMIC_RELEASE);
+    }
+
+    a = (struct atom *)_d_alloc(d,sizeof(struct atom) + strlen(name));
+    a->hash = hash;
+    a->refs = 1;
+    a->owned = a->targets = 0;
+    a->up = a->kids = a->knext = a->kprev = 0;
+    a->watches = 0;
+    strcpy(a->name, name);
+    a->next = d->atoms[hash & (d->atomsize - 1)];
+    __atomic_store_n(&d->atoms[hash & (d->atomsize - 1)], a, __ATOMIC_RELEASE);
+    d->natoms++;
+    return a->name;
+}
+
+void _atom_domain(mdnsd d, struct atom *a)
+{ // link a under the rest of its name, and that under its own, up to the top level (each holding a reference to the next)
+    char *rest;
+    struct atom *up;
+    while(a->up == 0 && (rest = strchr(a->name,'.')) != 0 && rest[1] != 0)
+    {
+        up = ATOM(_atom(d,rest + 1));
+        a->up = up;
+        if((a->knext = up->kids) != 0) a->knext->kprev = a;
+        up->kids = a;
+        a = up;
+    }
+}
+
+char *_atom_ref(char *name)
+{ // another reference to an atom we already have
+    if(name) ATOM(name)->refs++;
+    return name;
+}
+
+void _atom_free(mdnsd d, char *name)
+{ // drop a reference, the last one frees it
+    struct atom *a, *cur;
+    int i;
+    if(name == 0 || --(a = ATOM(name))->refs > 0) return;
+    i = a->hash & (d->atomsize - 1);
+    if(d->atoms[i] == a) __atomic_store_n(&d->atoms[i], a->next, __ATOMIC_RELEASE);
+    else {
+        for(cur = d->atoms[i]; cur->next != a; cur = cur->next);
+        __atomic_store_n(&cur->next, a->next, __ATOMIC_RELEASE);
+    }
+    d->natoms--;
+    if(a->up)
+    { // out of its domain, which may go too
+        if(a->knext) a->knext->kprev = a->kprev;
+        if(a->kprev) a->kprev->knext = a->knext;
+        else a->up->kids = a->knext;
+        _atom_free(d,a->up->name);
+    }
+    a->epoch = d->epoch; // a reader could be on it yet
+    a->limbo = d->latoms;
+    d->latoms = a;
+}
+
+void _ci_init(mdnsd d, struct cindex *t, int size)
+{
+    t->slots = (struct cslot *)_d_alloc(d,sizeof(struct cslot) * size);
+    bzero(t->slots,sizeof(struct cslot) * size);
+    t->size = size;
+    t->used = t->tombs = 0;
+}
+
+// the slot for this name/type, if it's in t
+struct cslot *_ci_slot(struct cindex *t, char *name, int type)
+{
+    int i;
+    if(t->size == 0) return 0;
+    for(i = ATOM(name)->hash & (t->size - 1); t->slots[i].name != 0; i = (i + 1) & (t->size - 1))
+        if(t->slots[i].name == name && t->slots[i].type == type) return &t->slots[i];
+    return 0;
+}
+
+// first entry of the first slot for name (of type, or any if 255) from i on in its run
+struct cached *_ci_scan(struct cindex *t, int i, char *name, int type)
+{
+    if(t->size == 0) return 0;
+    for(i &= t->size - 1; t->slots[i].name != 0; i = (i + 1) & (t->size - 1))
+        if(t->slots[i].name == name && (type == 255 || t->slots[i].type == type)) return t->slots[i].list;
+    return 0;
+}
+
+// take a free slot for a name/type that isn't in t yet
+struct cslot *_ci_put(struct cindex *t, char *name, int type, struct cached *list)
 {
-    const unsigned char *name = (const unsigned char *)s;
-    unsigned long h = 0, g;
+    int i;
+    for(i = ATOM(name)->hash & (t->size - 1); t->slots[i].name != 0 && t->slots[i].name != TOMB; i = (i + 1) & (t->size - 1));
+    if(t->slots[i].name == TOMB) t->tombs--;
+    t->slots[i].name = name;
+    t->slots[i].type = type;
+    t->slots[i].list = list;
+    t->used++;
+    return &t->slots[i];
+}
+
+void _ci_empty(struct cindex *t, struct cslot *s)
+{ // a tomb keeps the run intact for anything past it
+    s->name = TOMB;
+    s->list = 0;
+    t->used--;
+    t->tombs++;
+}
 
-    while (*name)
-    { /* do some fancy bitwanking on the string */
-        h = (h << 4) + (unsigned long)(*name++);
-        if ((g = (h & 0xF0000000UL))!=0)
-            h ^= (g >> 24);
-        h &= ~g;
+void _ci_move(mdnsd d, struct cslot *s)
+{ // move a whole slot over from the old index
+    _ci_put(&d->cache,s->name,s->type,s->list);
+    _ci_empty(&d->cold,s);
+}
+
+void _ci_step(mdnsd d)
+{ // move the next few slots along, dropping the old index once it's empty
+    struct cslot *s;
+    int n;
+    for(n = 0; n < REHASH && d->cold.used > 0 && d->cmove < d->cold.size; n++)
+    {
+        s = &d->cold.slots[d->cmove++];
+        if(s->name != 0 && s->name != TOMB) _ci_move(d,s);
     }
+    if(d->cold.used > 0) return;
+    _d_free(d,d->cold.slots);
+    bzero(&d->cold,sizeof(struct cindex));
+}
 
-    return (int)h;
+void _ci_grow(mdnsd d)
+{ // make sure there's room for another name/type, without ever rehashing everything at once
+    int size = d->cache.size;
+    if(d->cold.size) { _ci_step(d); return; }
+    if((d->cache.used + d->cache.tombs + 1) * 4 <= size * 3) return;
+    if(d->cache.used > size / 4) size *= 2; // otherwise it's mostly tombs, the same size clears them out
+    d->cold = d->cache;
+    d->cmove = 0;
+    _ci_init(d,&d->cache,size);
+    _ci_step(d);
 }
 
-// basic linked list and hash primitives
+// basic linked list and hash primitives, host has to be an atom
 struct query *_q_next(mdnsd d, struct query *q, char *host, int type)
 {
-    if(q == 0) q = d->queries[_namehash(host) % SPRIME];
+    if(q == 0) q = d->queries[ATOM(host)->hash % SPRIME];
     else q = q->next;
     for(;q != 0; q = q->next)
-        if(q->type == type && strcmp(q->name, host) == 0)
+        if(q->type == type && q->name == host)
             return q;
     return 0;
 }
 struct cached *_c_next(mdnsd d, struct cached *c, char *host, int type)
 {
-    if(c == 0) c = d->cache[_namehash(host) % LPRIME];
-    else c = c->next;
-    for(;c != 0; c = c->next)
-        if((type == c->rr.type || type == 255) && strcmp(c->rr.name, host) == 0)
-            return c;
-    return 0;
+    struct cslot *s;
+    if(c != 0 && c->next != 0) return c->next;
+    if(c == 0)
+    { // first in the new index, then the old one
+        if((c = _ci_scan(&d->cache,ATOM(host)->hash,host,type)) != 0) return c;
+        return _ci_scan(&d->cold,ATOM(host)->hash,host,type);
+    }
+    if(type != 255) return 0; // only ever the one name/type
+    if((s = _ci_slot(&d->cache,c->rr.name,c->rr.type)) != 0)
+    { // carry on with the other types past c's
+        if((c = _ci_scan(&d->cache,(s - d->cache.slots) + 1,host,type)) != 0) return c;
+        return _ci_scan(&d->cold,ATOM(host)->hash,host,type);
+    }
+    s = _ci_slot(&d->cold,c->rr.name,c->rr.type);
+    return _ci_scan(&d->cold,(s - d->cold.slots) + 1,host,type);
 }
 mdnsdr _r_next(mdnsd d, mdnsdr r, char *host, int type)
 {
-    if(r == 0) r = d->published[_namehash(host) % SPRIME];
+    if(r == 0) r = d->published[ATOM(host)->hash % SPRIME];
     else r = r->next;
     for(;r != 0; r = r->next)
-        if(type == r->rr.type && strcmp(r->rr.name, host) == 0)
+        if(type == r->rr.type && (char *)r->rr.name == host)
             return r;
     return 0;
 }
 
 int _rr_len(mdnsda rr)
-{
-    int len = 12; // name is always compressed (dup of earlier), plus normal stuff
-    if(rr->rdata) len += rr->rdlen;
-    if(rr->rdname) len += strlen(rr->rdname); // worst case
-    if(rr->ip) len += 4;
-    if(rr->type == QTYPE_PTR) len += 6; // srv record stuff
+{ // the most a record could ever take, nothing compressed, only used to keep appends inside the packet buffer
+    int len = 10 + strlen(rr->name) + 2;
+    if(rr->rdname) len += strlen(rr->rdname) + 2 + 6; // srv record stuff
+    else if(rr->rdata) len += rr->rdlen;
+    else len += 4;
     return len;
 }
 
-int _a_match(struct resource *r, mdnsda a)
-{ // compares new rdata with known a, painfully
-    if(strcmp(r->name,a->name) || r->type != a->type) return 0;
-    if(r->type == QTYPE_SRV && !strcmp(r->known.srv.name,a->rdname) && a->srv.port == r->known.srv.port && a->srv.weight == r->known.srv.weight && a->srv.priority == r->known.srv.priority) return 1;
-    if((r->type == QTYPE_PTR || r->type == QTYPE_NS || r->type == QTYPE_CNAME) && !strcmp(a->rdname,r->known.ns.name)) return 1;
+char *_rr_rdname(struct resource *r)
+{ // the name in an incoming rr's rdata, if it has one
+    if(r->type == QTYPE_SRV) return r->known.srv.name;
+    if(r->type == QTYPE_PTR || r->type == QTYPE_NS || r->type == QTYPE_CNAME) return r->known.ns.name;
+    return 0;
+}
+
+int _a_match(struct resource *r, char *name, char *rdname, mdnsda a)
+{ // compares new rdata with known a, painfully, name and rdname are r's own as atoms (0 if there aren't any)
+    if(name != (char *)a->name || r->type != a->type) return 0;
+    if(r->type == QTYPE_SRV && rdname && rdname == (char *)a->rdname && a->srv.port == r->known.srv.port && a->srv.weight == r->known.srv.weight && a->srv.priority == r->known.srv.priority) return 1;
+    if((r->type == QTYPE_PTR || r->type == QTYPE_NS || r->type == QTYPE_CNAME) && rdname && rdname == (char *)a->rdname) return 1;
     if(r->rdlength == a->rdlen && !memcmp(r->rdata,a->rdata,r->rdlength)) return 1;
     return 0;
 }
@@ -136,6 +663,12 @@ int _tvdiff(struct timeval old, struct timeval new)
     return (new.tv_usec - old.tv_usec) + udiff;
 }
 
+long int _tvcmp(struct timeval a, struct timeval b)
+{ // <0, 0 or >0 as a is before, at or after b, for ones that can be further apart than _tvdiff() holds
+    if(a.tv_sec != b.tv_sec) return (long int)(a.tv_sec - b.tv_sec);
+    return (long int)(a.tv_usec - b.tv_usec);
+}
+
 // make sure not already on the list, then insert
 void _r_push(mdnsdr *list, mdnsdr r)
 {
@@ -151,15 +684,6 @@ void _r_probe(mdnsd d, mdnsdr r)
 {
 }
 
-// force any r out right away, if valid
-void _r_publish(mdnsd d, mdnsdr r)
-{
-    if(r->unique && r->unique < 5) return; // probing already
-    r->tries = 0;
-    d->publish.tv_sec = d->now.tv_sec; d->publish.tv_usec = d->now.tv_usec;
-    _r_push(&d->a_publish,r);
-}
-
 // send r out asap
 void _r_send(mdnsd d, mdnsdr r)
 {
@@ -179,12 +703,290 @@ void _r_send(mdnsd d, mdnsdr r)
     _r_push(&d->a_pause,r);
 }
 
+void _r_rdata(struct message *m, mdnsdr r)
+{ // splice in the pre-encoded data bits of a published record
+    if(r->wrdname && r->rr.type == QTYPE_SRV) { message_rdata_srv_enc(m, r->rr.srv.priority, r->rr.srv.weight, r->rr.srv.port, r->wrdname); return; }
+    if(r->wrdname) { message_rdata_enc(m, r->wrdname); return; }
+    if(r->rr.rdata) { message_rdata_raw(m, r->rr.rdata, r->rr.rdlen); return; }
+    if(r->rr.ip) message_rdata_long(m, r->rr.ip);
+}
+
+int _r_an(mdnsd d, struct message *m, mdnsdr r)
+{ // append a published answer, kept only if the packet still fits in the frame (or it's the only one), 0 if it didn't
+    int len = message_packet_len(m);
+    if(len + _rr_len(&r->rr) > MAX_PACKET_LEN) return 0;
+    message_mark(m);
+    message_an_enc(m, r->wname, r->rr.type, r->unique ? d->class + 32768 : d->class, r->rr.ttl);
+    _r_rdata(m, r);
+    if(len == 12 || message_packet_len(m) <= d->frame) return 1;
+    message_rollback(m);
+    return 0;
+}
+
+int _r_ar(mdnsd d, struct message *m, mdnsdr r)
+{ // append a published record as an additional one, kept only if the packet still fits in the frame, 0 if it didn't
+    if(message_packet_len(m) + _rr_len(&r->rr) > MAX_PACKET_LEN) return 0;
+    message_mark(m);
+    message_ar_enc(m, r->wname, r->rr.type, r->unique ? d->class + 32768 : d->class, r->rr.ttl);
+    _r_rdata(m, r);
+    if(message_packet_len(m) <= d->frame) return 1;
+    message_rollback(m);
+    return 0;
+}
+
+int _r_want(mdnsdr *an, int count, mdnsdr *x, int xcount, mdnsdr r, unsigned long int now)
+{ // r isn't going away, wasn't just listed as known (if now isn't 0), and isn't in the answer yet
+    int i;
+    if(r->rr.ttl == 0 || (r->unique && r->unique < 5) || (now && r->known && now - r->known <= 1) || xcount == EXTRA) return 0;
+    for(i = 0; i < count; i++) if(an[i] == r) return 0;
+    for(i = 0; i < xcount; i++) if(x[i] == r) return 0;
+    return 1;
+}
+
+// what goes with these answers as additional records (rfc6763 section 12), SRV+TXT+A for a PTR and A for an SRV
+//   into want, returns how many, the ones just listed as known are left out if now isn't 0
+int _r_more(mdnsd d, mdnsdr *an, int count, mdnsdr *want, unsigned long int now)
+{
+    mdnsdr r, a;
+    int i, n = 0;
+    for(i = 0; i < count; i++)
+    { // the instances' SRV and TXT
+        if(an[i]->rr.type != QTYPE_PTR || an[i]->rr.rdname == 0 || an[i]->rr.ttl == 0) continue;
+        for(r = 0; (r = _r_next(d,r,an[i]->rr.rdname,QTYPE_SRV)) != 0;)
+            if(_r_want(an,count,want,n,r,now)) want[n++] = r;
+        for(r = 0; (r = _r_next(d,r,an[i]->rr.rdname,QTYPE_TXT)) != 0;)
+            if(_r_want(an,count,want,n,r,now)) want[n++] = r;
+    }
+    for(i = 0; i < count + n; i++)
+    { // the hosts of the SRVs, answered or just added
+        a = i < count ? an[i] : want[i - count];
+        if(a->rr.type != QTYPE_SRV || a->rr.rdname == 0 || a->rr.ttl == 0) continue;
+        for(r = 0; (r = _r_next(d,r,a->rr.rdname,QTYPE_A)) != 0;)
+            if(_r_want(an,count,want,n,r,now)) want[n++] = r;
+    }
+    return n;
+}
+
+// add what goes with these answers as additional records while they fit, leaving out what was just listed as known if filter is set
+//   returns how many went, and which in x if it isn't 0
+int _r_extra(mdnsd d, struct message *m, mdnsdr *an, int count, mdnsdr *x, int filter)
+{
+    mdnsdr want[EXTRA];
+    int i, n, xcount = 0;
+    n = _r_more(d,an,count,want,filter ? d->now.tv_sec : 0);
+    for(i = 0; i < n; i++)
+    {
+        if(!_r_ar(d,m,want[i])) continue;
+        if(x) x[xcount] = want[i];
+        xcount++;
+    }
+    return xcount;
+}
+
+void _r_needed(mdnsd d, mdnsdr r, struct message *m, char **known)
+{ // r answers m, what goes with it and m didn't list as known can't be held back by anyone else's known answers for now
+    mdnsdr want[EXTRA];
+    int i, j, n;
+    n = _r_more(d,&r,1,want,0);
+    for(i = 0; i < n; i++)
+    {
+        for(j = 0; j < m->ancount && !_a_match(&m->an[j],known[j * 2],known[j * 2 + 1],&want[i]->rr); j++);
+        if(j < m->ancount) continue;
+        want[i]->wanted = d->now.tv_sec;
+        want[i]->known = 0;
+    }
+}
+
+void _rc_free(mdnsd d, struct response *rc)
+{ // unlink from the cache and any pending send, then free
+    struct response *cur;
+    int i;
+    if(d->responses == rc) d->responses = rc->next;
+    else {
+        for(cur = d->responses; cur->next != rc; cur = cur->next);
+        cur->next = rc->next;
+    }
+    if(rc->pending)
+    {
+        if(d->rsend == rc) d->rsend = rc->list;
+        else {
+            for(cur = d->rsend; cur->list != rc; cur = cur->list);
+            cur->list = rc->list;
+        }
+    }
+    for(i = 0; i < rc->qdcount; i++) _atom_free(d,rc->qd[i].name);
+    _d_free(d,rc->packet);
+    _d_free(d,rc);
+    d->rcount--;
+}
+
+int _rc_pulls(struct response *rc, mdnsdr r)
+{ // r goes with something in rc (see _r_more()), the SRV/TXT of an instance it answers with or the A of an SRV in it
+    mdnsdr a;
+    int i;
+    for(i = 0; i < rc->count + rc->xcount; i++)
+    {
+        a = i < rc->count ? rc->r[i] : rc->x[i - rc->count];
+        if(a->rr.rdname == 0 || a->rr.rdname != r->rr.name) continue;
+        if(a->rr.type == QTYPE_PTR && (r->rr.type == QTYPE_SRV || r->rr.type == QTYPE_TXT)) return 1;
+        if(a->rr.type == QTYPE_SRV && r->rr.type == QTYPE_A) return 1;
+    }
+    return 0;
+}
+
+// drop any cached response that r is in or could now be in (as an answer or an additional record), r is changing or going away
+void _rc_drop(mdnsd d, mdnsdr r)
+{
+    struct response *rc, *next;
+    int i, j;
+    for(rc = d->responses; rc != 0; rc = next)
+    {
+        next = rc->next;
+        for(i = 0; i < rc->count && rc->r[i] != r; i++);
+        for(j = 0; j < rc->xcount && rc->x[j] != r; j++);
+        if(i == rc->count && j == rc->xcount && !_rc_pulls(rc,r))
+        {
+            for(j = 0; j < rc->qdcount; j++)
+                if(rc->qd[j].type == r->rr.type && rc->qd[j].name == (char *)r->rr.name) break;
+            if(j == rc->qdcount) continue;
+        }
+        // still owed to someone, so send the others the long way
+        if(rc->pending)
+            for(i = 0; i < rc->count; i++)
+                if(rc->r[i] != r) _r_send(d,rc->r[i]);
+        _rc_free(d,rc);
+    }
+}
+
+// build and cache the response for these questions from these records, 0 if it won't fit in one frame
+struct response *_rc_new(mdnsd d, char **qn, int *qt, int qdcount, mdnsdr *rs, int count, unsigned long int key)
+{
+    struct response *rc, *last;
+    struct message *m = d->out;
+    mdnsdr x[EXTRA];
+    int i, xcount;
+
+    message_reset(m);
+    m->header.qr = 1;
+    m->header.aa = 1;
+    for(i = 0; i < count; i++)
+        if(!_r_an(d,m,rs[i])) return 0;
+    xcount = _r_extra(d,m,rs,count,x,0); // it's reused for others, so nothing anyone listed as known is left out
+
+    // make room, the least recently used one not waiting to go out
+    if(d->rcount >= RCACHE)
+    {
+        for(rc = d->responses, last = 0; rc != 0; rc = rc->next)
+            if(!rc->pending) last = rc;
+        if(last == 0) return 0;
+        _rc_free(d,last);
+    }
+
+    rc = (struct response *)_d_alloc(d,sizeof(struct response));
+    bzero(rc,sizeof(struct response));
+    rc->key = key;
+    rc->qdcount = qdcount;
+    for(i = 0; i < qdcount; i++)
+    {
+        rc->qd[i].name = _atom_ref(qn[i]);
+        rc->qd[i].type = qt[i];
+    }
+    rc->count = count;
+    for(i = 0; i < count; i++)
+    {
+        rc->r[i] = rs[i];
+        if(!rs[i]->unique) rc->shared = 1;
+    }
+    rc->xcount = xcount;
+    for(i = 0; i < xcount; i++) rc->x[i] = x[i];
+    rc->len = message_packet_len(m);
+    rc->packet = (unsigned char *)_d_alloc(d,rc->len);
+    memcpy(rc->packet, message_packet(m), rc->len);
+    rc->next = d->responses;
+    d->responses = rc;
+    d->rcount++;
+    return rc;
+}
+
+// answer a whole query from the response cache (building it if needed), returns 0 if it has to be answered record by record
+int _rc_answer(mdnsd d, struct message *m)
+{
+    struct response *rc, *last;
+    char *name, *qn[RCQ];
+    int qt[RCQ];
+    mdnsdr r, rs[RCR];
+    unsigned long int key = 0;
+    int i, j, qdcount = 0, count = 0;
+
+    // normalize to the distinct questions we have answers for, in any order, and every answer must be settled
+    for(i = 0; i < m->qdcount; i++)
+    {
+        if(m->qd[i].class != d->class || (name = _atom_find(d,m->qd[i].name)) == 0 || (r = _r_next(d,0,name,m->qd[i].type)) == 0) continue;
+        for(j = 0; j < qdcount; j++)
+            if(qt[j] == m->qd[i].type && qn[j] == name) break;
+        if(j < qdcount) continue;
+        if(qdcount == RCQ) return 0;
+        qn[qdcount] = name;
+        qt[qdcount++] = m->qd[i].type;
+        key += ATOM(name)->hash + m->qd[i].type;
+        for(; r != 0; r = _r_next(d,r,name,m->qd[i].type))
+        {
+            if((r->unique && r->unique < 5) || r->tries < 4 || r->rr.ttl == 0 || count == RCR) return 0;
+            rs[count++] = r;
+        }
+    }
+    if(qdcount == 0) return 1;
+
+    // same set of questions as before?
+    for(rc = d->responses, last = 0; rc != 0; last = rc, rc = rc->next)
+    {
+        if(rc->key != key || rc->qdcount != qdcount) continue;
+        for(i = 0; i < qdcount; i++)
+        {
+            for(j = 0; j < qdcount; j++)
+                if(rc->qd[j].type == qt[i] && rc->qd[j].name == qn[i]) break;
+            if(j == qdcount) break;
+        }
+        if(i == qdcount) break;
+    }
+    if(rc != 0 && last != 0)
+    { // move to the front, most recently used
+        last->next = rc->next;
+        rc->next = d->responses;
+        d->responses = rc;
+    }
+    if(rc == 0 && (rc = _rc_new(d,qn,qt,qdcount,rs,count,key)) == 0) return 0;
+
+    // already going out?
+    if(rc->pending) return 1;
+    rc->pending = 1;
+    rc->at.tv_sec = d->now.tv_sec;
+    rc->at.tv_usec = d->now.tv_usec;
+    if(rc->shared)
+    { // random 20-120 msec, like shared answers
+        rc->at.tv_usec += ((d->now.tv_usec % 100) + 20) * 1000;
+        while(rc->at.tv_usec >= 1000000) { rc->at.tv_sec++; rc->at.tv_usec -= 1000000; }
+    }
+    rc->list = d->rsend;
+    d->rsend = rc;
+    return 1;
+}
+
+// force any r out right away, if valid
+void _r_publish(mdnsd d, mdnsdr r)
+{
+    _rc_drop(d,r);
+    if(r->unique && r->unique < 5) return; // probing already
+    r->tries = 0;
+    d->publish.tv_sec = d->now.tv_sec; d->publish.tv_usec = d->now.tv_usec;
+    _r_push(&d->a_publish,r);
+}
+
 // create generic unicast response struct
 void _u_push(mdnsd d, mdnsdr r, int id, unsigned long int to, unsigned short int port)
 {
     struct unicast *u;
-    u = (struct unicast *)malloc(sizeof(struct unicast));
-    bzero(u,sizeof(struct unicast));
+    u = (struct unicast *)_p_get(d,&d->punicast);
     u->r = r;
     u->id = id;
     u->to = to;
@@ -193,184 +995,945 @@ void _u_push(mdnsd d, mdnsdr r, int id, unsigned long int to, unsigned short int
     d->uanswers = u;
 }
 
-void _q_reset(mdnsd d, struct query *q)
+// the TC query (and continuations) from this host whose answers are still being held, if any
+struct truncated *_tc_find(mdnsd d, unsigned long int ip, unsigned short int port)
 {
-    struct cached *cur = 0;
-    q->nexttry = 0;
-    q->tries = 0;
-    while(cur = _c_next(d,cur,q->name,q->type))
-        if(q->nexttry == 0 || cur->rr.ttl - 7 < q->nexttry) q->nexttry = cur->rr.ttl - 7;
-    if(q->nexttry != 0 && q->nexttry < d->checkqlist) d->checkqlist = q->nexttry;
+    struct truncated *t;
+    for(t = d->truncated; t != 0; t = t->next)
+        if(t->ip == ip && t->port == port) return t;
+    return 0;
+}
+
+struct truncated *_tc_new(mdnsd d, unsigned long int ip, unsigned short int port)
+{ // start holding the answers to a TC query, for a random 400-500 msec
+    struct truncated *t;
+    t = (struct truncated *)_d_alloc(d,sizeof(struct truncated));
+    bzero(t,sizeof(struct truncated));
+    t->ip = ip;
+    t->port = port;
+    t->at.tv_sec = d->now.tv_sec;
+    t->at.tv_usec = d->now.tv_usec + ((d->now.tv_usec % 101) + 400) * 1000;
+    while(t->at.tv_usec >= 1000000) { t->at.tv_sec++; t->at.tv_usec -= 1000000; }
+    t->next = d->truncated;
+    d->truncated = t;
+    return t;
+}
+
+void _tc_add(mdnsd d, struct truncated *t, mdnsdr r)
+{ // hold r as an answer, once
+    int i;
+    for(i = 0; i < t->count; i++)
+        if(t->r[i] == r) return;
+    if(t->count == t->size)
+    {
+        t->size = t->size ? t->size * 2 : 8;
+        t->r = (mdnsdr *)_d_grow(d, t->r, sizeof(mdnsdr) * t->count, sizeof(mdnsdr) * t->size);
+    }
+    t->r[t->count++] = r;
+}
+
+void _tc_known(struct truncated *t, struct message *m, char **known)
+{ // forget any held answers they've now listed as known (known has the atoms for each, see _known())
+    int i, j;
+    for(i = 0; i < t->count;)
+    {
+        for(j = 0; j < m->ancount && !_a_match(&m->an[j],known[j * 2],known[j * 2 + 1],&t->r[i]->rr); j++);
+        if(j < m->ancount) t->r[i] = t->r[--t->count];
+        else i++;
+    }
+}
+
+void _tc_free(mdnsd d, struct truncated *t, int send)
+{ // unlink and free, sending whatever answers are still held first if asked to
+    struct truncated *cur;
+    int i;
+    if(d->truncated == t) d->truncated = t->next;
+    else {
+        for(cur = d->truncated; cur->next != t; cur = cur->next);
+        cur->next = t->next;
+    }
+    if(send)
+        for(i = 0; i < t->count; i++) _r_send(d,t->r[i]);
+    _d_free(d,t->r);
+    _d_free(d,t);
+}
+
+// r is going away, stop holding it for anyone
+void _tc_drop(mdnsd d, mdnsdr r)
+{
+    struct truncated *t;
+    int i;
+    for(t = d->truncated; t != 0; t = t->next)
+        for(i = 0; i < t->count; i++)
+            if(t->r[i] == r) { t->r[i] = t->r[--t->count]; break; }
+}
+
+void _c_ttl(struct cached *c, unsigned long int ttl)
+{ // readers in other threads look at it while it's live
+    __atomic_store_n(&c->rr.ttl, ttl, __ATOMIC_RELAXED);
+}
+
+unsigned int _rand(mdnsd d)
+{ // xorshift, good enough for jitter
+    d->seed ^= d->seed << 13;
+    d->seed ^= d->seed >> 17;
+    d->seed ^= d->seed << 5;
+    return d->seed;
+}
+
+// query heap, same as the cached ones but on nexttry
+void _qh_swap(mdnsd d, int a, int b)
+{
+    struct query *q = d->qheap[a];
+    d->qheap[a] = d->qheap[b];
+    d->qheap[b] = q;
+    d->qheap[a]->heap = a;
+    d->qheap[b]->heap = b;
+}
+
+void _qh_fix(mdnsd d, struct query *q)
+{
+    int i = q->heap, child;
+    while(i > 0 && _tvcmp(d->qheap[(i - 1) / 2]->nexttry,d->qheap[i]->nexttry) > 0)
+    {
+        _qh_swap(d,i,(i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while((child = i * 2 + 1) < d->qcount)
+    {
+        if(child + 1 < d->qcount && _tvcmp(d->qheap[child + 1]->nexttry,d->qheap[child]->nexttry) < 0) child++;
+        if(_tvcmp(d->qheap[i]->nexttry,d->qheap[child]->nexttry) <= 0) break;
+        _qh_swap(d,i,child);
+        i = child;
+    }
+}
+
+void _qh_push(mdnsd d, struct query *q)
+{
+    if(d->qcount == d->qsize)
+    {
+        d->qsize = d->qsize ? d->qsize * 2 : HEAP;
+        d->qheap = (struct query **)_d_grow(d, d->qheap, sizeof(struct query *) * d->qcount, sizeof(struct query *) * d->qsize);
+    }
+    d->qheap[d->qcount] = q;
+    q->heap = d->qcount++;
+    _qh_fix(d,q);
+}
+
+void _qh_remove(mdnsd d, struct query *q)
+{
+    int i = q->heap;
+    if(i != --d->qcount)
+    {
+        d->qheap[i] = d->qheap[d->qcount];
+        d->qheap[i]->heap = i;
+        _qh_fix(d,d->qheap[i]);
+    }
+}
+
+void _c_refresh(mdnsd d, struct cached *c)
+{ // the next point to ask for it again before it expires, 80, 85, 90 then 95% of its ttl plus up to 2% (rfc6762 section 5.2)
+    if(c->rstep >= 4) { c->refresh = 0; return; }
+    c->refresh = c->at + (c->life * (80 + c->rstep * 5) + _rand(d) % (c->life * 2 + 1)) / 100;
+}
+
+int _q_sooner(struct query *q, unsigned long int refresh)
+{ // move q's nexttry up to refresh (a whole second) if that's sooner, returns if it was
+    if(refresh == 0 || (long int)(refresh - q->nexttry.tv_sec) > 0 || (refresh == q->nexttry.tv_sec && q->nexttry.tv_usec == 0)) return 0;
+    q->nexttry.tv_sec = refresh;
+    q->nexttry.tv_usec = 0;
+    return 1;
+}
+
+void _q_when(mdnsd d, struct query *q, struct cached *c)
+{ // c is q's now, make sure q wakes up in time to refresh it
+    if(_q_sooner(q,c->refresh)) _qh_fix(d,q);
+}
+
+// expiry heaps, each entry knows its own place in the one it's in (which depends on c->q) so it can be moved or taken out
+#define HEAPOF(d,c) (&(d)->heap[(c)->q != 0])
+
+void _h_swap(struct heap *h, int a, int b)
+{
+    struct cached *c = h->e[a];
+    h->e[a] = h->e[b];
+    h->e[b] = c;
+    h->e[a]->heap = a;
+    h->e[b]->heap = b;
+}
+
+void _h_fix(mdnsd d, struct cached *c)
+{ // c's ttl changed, move it up or down to where it goes now
+    struct heap *h = HEAPOF(d,c);
+    int i = c->heap, child;
+    while(i > 0 && h->e[(i - 1) / 2]->rr.ttl > h->e[i]->rr.ttl)
+    {
+        _h_swap(h,i,(i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while((child = i * 2 + 1) < h->count)
+    {
+        if(child + 1 < h->count && h->e[child + 1]->rr.ttl < h->e[child]->rr.ttl) child++;
+        if(h->e[i]->rr.ttl <= h->e[child]->rr.ttl) break;
+        _h_swap(h,i,child);
+        i = child;
+    }
+}
+
+void _h_push(mdnsd d, struct cached *c)
+{
+    struct heap *h = HEAPOF(d,c);
+    if(h->count == h->size)
+    {
+        h->size = h->size ? h->size * 2 : HEAP;
+        h->e = (struct cached **)_d_grow(d, h->e, sizeof(struct cached *) * h->count, sizeof(struct cached *) * h->size);
+    }
+    h->e[h->count] = c;
+    c->heap = h->count++;
+    _h_fix(d,c);
+}
+
+void _h_remove(mdnsd d, struct cached *c)
+{
+    struct heap *h = HEAPOF(d,c);
+    int i = c->heap;
+    if(i != --h->count)
+    {
+        h->e[i] = h->e[h->count];
+        h->e[i]->heap = i;
+        _h_fix(d,h->e[i]);
+    }
+}
+
+// the cached entry that expires next, if any
+struct cached *_h_first(mdnsd d)
+{
+    if(d->heap[0].count == 0) return d->heap[1].count ? d->heap[1].e[0] : 0;
+    if(d->heap[1].count == 0 || d->heap[0].e[0]->rr.ttl <= d->heap[1].e[0]->rr.ttl) return d->heap[0].e[0];
+    return d->heap[1].e[0];
+}
+
+void _c_query(mdnsd d, struct cached *c, struct query *q)
+{ // attach c to q (or to nothing), switching heaps if that changes
+    if((c->q != 0) == (q != 0)) c->q = q;
+    else {
+        _h_remove(d,c);
+        c->q = q;
+        _h_push(d,c);
+    }
+    if(q) _q_when(d,q,c);
+}
+
+void _q_ask(mdnsd d, struct query *q)
+{ // q was just asked, back off, with up to 10% more so everyone's queries don't line up
+    //   to the usec, a whole second from X.95 isn't X+1 (the first two at least a second apart, rfc6762 section 5.2)
+    q->ask.tv_sec = d->now.tv_sec + q->interval + (q->interval >= 10 ? _rand(d) % (q->interval / 10) : 0);
+    q->ask.tv_usec = d->now.tv_usec;
+    q->interval = q->interval * 2 > BACKOFF ? BACKOFF : q->interval * 2;
+}
+
+void _q_seen(mdnsd d, struct query *q, int question)
+{ // someone else asked q (or answered it), if ours was more than halfway there it counts as asked (rfc6762 section 7.3)
+    struct cached *c = 0;
+    if((long int)(q->ask.tv_sec - d->now.tv_sec) <= q->interval / 4) _q_ask(d,q);
+    if(!question) return; // answers refresh their own entries already
+    while(c = _c_next(d,c,q->name,q->type)) // and any refresh it'd have asked within the jitter of
+        for(; c->refresh && c->refresh <= d->now.tv_sec + c->life / 50; c->rstep++, _c_refresh(d,c));
+}
+
+int _q_due(mdnsd d, struct query *q)
+{ // q's nexttry came, returns if it's to be asked, and moves it along to when it's next needed
+    struct cached *c = 0;
+    int due = 0;
+    if(_tvcmp(q->ask,d->now) <= 0)
+    {
+        due = 1;
+        _q_ask(d,q);
+    }
+    q->nexttry = q->ask;
+    while(c = _c_next(d,c,q->name,q->type))
+    {
+        for(; c->refresh && c->refresh <= d->now.tv_sec; c->rstep++, _c_refresh(d,c)) due = 1;
+        _q_sooner(q,c->refresh);
+    }
+    _qh_fix(d,q);
+    return due;
 }
 
 void _q_done(mdnsd d, struct query *q)
 { // no more query, update all it's cached entries, remove from lists
     struct cached *c = 0;
     struct query *cur;
-    int i = _namehash(q->name) % LPRIME;
-    while(c = _c_next(d,c,q->name,q->type)) c->q = 0;
-    if(d->qlist == q) d->qlist = q->list;
-    else {
-        for(cur=d->qlist;cur->list != q;cur = cur->list);
-        cur->list = q->list;
+    struct mdnsds_struct *s;
+    int i = ATOM(q->name)->hash % SPRIME;
+    while((s = q->subs) != 0)
+    {
+        q->subs = s->next;
+        _p_put(&d->psub,s);
+    }
+    while(c = _c_next(d,c,q->name,q->type)) _c_query(d,c,0);
+    _qh_remove(d,q);
+    if(q->known)
+    { // still owed known answers
+        if(d->asked == q) d->asked = q->list;
+        else {
+            for(cur=d->asked;cur->list != q;cur = cur->list);
+            cur->list = q->list;
+        }
     }
     if(d->queries[i] == q) d->queries[i] = q->next;
     else {
         for(cur=d->queries[i];cur->next != q;cur = cur->next);
         cur->next = q->next;
     }
-    free(q->name);
-    free(q);
+    _atom_free(d,q->name);
+    _p_put(&d->pquery,q);
 }
 
 void _r_done(mdnsd d, mdnsdr r)
 { // buh-bye, remove from hash and free
     mdnsdr cur = 0;
-    int i = _namehash(r->rr.name) % SPRIME;
+    int i = ATOM(r->rr.name)->hash % SPRIME;
+    _rc_drop(d,r);
+    _tc_drop(d,r);
     if(d->published[i] == r) d->published[i] = r->next;
     else {
         for(cur=d->published[i];cur && cur->next != r;cur = cur->next);
         if(cur) cur->next = r->next;
     }
-    free(r->rr.name);
-    free(r->rr.rdata);
-    free(r->rr.rdname);
-    free(r);
+    _atom_free(d,r->rr.name);
+    _rdata_free(d,r->small,r->rr.rdata);
+    _atom_free(d,r->rr.rdname);
+    _d_free(d,r->wname);
+    _d_free(d,r->wrdname);
+    _p_put(&d->precord,r);
 }
 
+void _q_sweep(mdnsd d, struct query *q)
+{ // free whatever was unsubscribed, and the query with the last of them
+    struct mdnsds_struct *s, **sp;
+    for(sp = &q->subs; (s = *sp) != 0;)
+    {
+        if(s->answer) { sp = &s->next; continue; }
+        *sp = s->next;
+        _p_put(&d->psub,s);
+    }
+    if(q->subs == 0) _q_done(d,q);
+}
+void _s_drop(mdnsd d, mdnsds s)
+{
+    struct query *q = s->q;
+    s->answer = 0;
+    if(q->own == s) q->own = 0;
+    if(q->busy == 0) _q_sweep(d,q);
+}
 void _q_answer(mdnsd d, struct cached *c)
-{ // call the answer function with this cached entry
-    if(c->rr.ttl <= d->now.tv_sec) c->rr.ttl = 0;
-    if(c->q->answer(&c->rr,c->q->arg) == -1) _q_done(d, c->q);
+{ // call every subscriber's answer function with this cached entry
+    struct query *q = c->q;
+    struct mdnsds_struct *s;
+    if(c->rr.ttl <= d->now.tv_sec) _c_ttl(c,0);
+    q->busy++;
+    for(s = q->subs; s != 0; s = s->next)
+        if(s->answer && s->answer(&c->rr,s->arg) == -1) _s_drop(d,s);
+    if(--q->busy == 0) _q_sweep(d,q);
 }
 
+void _i_free(mdnsd d, struct instance *i)
+{
+    _atom_free(d,i->i.name);
+    _atom_free(d,i->i.host);
+    _d_free(d,i->i.txt);
+    _d_free(d,i);
+}
+void _b_free(mdnsd d, struct mdnsdb_struct *b)
+{ // just the memory, its subscriptions are already gone (or going with their queries)
+    struct mdnsdb_struct *cur;
+    struct instance *i;
+    while((i = b->list) != 0)
+    {
+        b->list = i->next;
+        _i_free(d,i);
+    }
+    if(d->browses == b) d->browses = b->next;
+    else {
+        for(cur = d->browses; cur->next != b; cur = cur->next);
+        cur->next = b->next;
+    }
+    _atom_free(d,b->service);
+    _d_free(d,b);
+}
 void _conflict(mdnsd d, mdnsdr r)
 {
     r->conflict(r->rr.name,r->rr.type,r->arg);
     mdnsd_done(d,r);
 }
 
-void _c_expire(mdnsd d, struct cached **list)
-{ // expire any old entries in this list
-    struct cached *next, *cur = *list, *last = 0;
-    while(cur != 0)
+// what a cached entry counts for against the limit, its node and rdata, and its name and rdname as if it were the only one using them
+unsigned long int _c_bytes(char *name, char *rdname, int rdlen)
+{
+    unsigned long int bytes = sizeof(struct cached) + sizeof(struct atom) + strlen(name);
+    if(rdlen > SMALL) bytes += rdlen;
+    if(rdname) bytes += sizeof(struct atom) + strlen(rdname);
+    return bytes;
+}
+
+void _c_unlink(mdnsd d, struct cached *c)
+{ // take c out of its slot, emptying the slot if it was the last one there
+    struct cindex *t = &d->cache;
+    struct cslot *s;
+    struct cached *cur;
+    if((s = _ci_slot(t,c->rr.name,c->rr.type)) == 0) s = _ci_slot(t = &d->cold,c->rr.name,c->rr.type);
+    if(s->list == c) s->list = c->next;
+    else {
+        for(cur = s->list; cur->next != c; cur = cur->next);
+        cur->next = c->next;
+    }
+    if(s->list == 0) _ci_empty(t,s);
+}
+
+void _c_free(mdnsd d, struct cached *c)
+{ // retired, a reader could be on it yet (see _e_reclaim())
+    c->at = d->epoch;
+    c->next = d->lcached;
+    d->lcached = c;
+}
+
+void _c_release(mdnsd d, struct cached *c)
+{
+    _atom_free(d,c->rr.name);
+    _rdata_free(d,c->small,c->rr.rdata);
+    _atom_free(d,c->rr.rdname);
+    _p_put(&d->pcached,c);
+}
+
+void _w_free(mdnsd d, struct mdnsdw_struct *w)
+{
+    struct mdnsdw_struct **wp;
+    for(wp = &ATOM(w->domain)->watches; *wp != w; wp = &(*wp)->next);
+    *wp = w->next;
+    for(wp = &d->watches; *wp != w; wp = &(*wp)->all);
+    *wp = w->all;
+    _atom_free(d,w->domain);
+    _d_free(d,w);
+}
+void _w_drop(mdnsd d, struct mdnsdw_struct *w)
+{
+    w->answer = 0;
+    if(d->wbusy == 0) _w_free(d,w);
+    else {
+        w->dead = d->wdead;
+        d->wdead = w;
+    }
+}
+void _w_exit(mdnsd d)
+{ // leaving watch callbacks, free whatever was stopped in them
+    struct mdnsdw_struct *w;
+    if(--d->wbusy > 0) return;
+    while((w = d->wdead) != 0)
     {
-        next = cur->next;
-        if(d->now.tv_sec >= cur->rr.ttl)
-        {
-            if(last) last->next = next;
-            if(*list == cur) *list = next; // update list pointer if the first one expired
-            if(cur->q) _q_answer(d,cur);
-            free(cur->rr.name);
-            free(cur->rr.rdata);
-            free(cur->rr.rdname);
-            free(cur);
-        }else{
-            last = cur;
-        }
-        cur = next;
+        d->wdead = w->dead;
+        _w_free(d,w);
+    }
+}
+void _w_answer(mdnsd d, struct cached *c)
+{ // tell everyone watching a domain c is in, its own name and each one above it
+    struct atom *a;
+    struct mdnsdw_struct *w;
+    if(d->watches == 0) return;
+    if(c->rr.ttl <= d->now.tv_sec) _c_ttl(c,0);
+    d->wbusy++;
+    for(a = ATOM(c->rr.name); a != 0; a = a->up)
+        for(w = a->watches; w != 0; w = w->next)
+            if(w->answer && (w->type == 255 || w->type == c->rr.type) && w->answer(&c->rr,w->arg) == -1) _w_drop(d,w);
+    _w_exit(d);
+}
+
+void _c_drop(mdnsd d, struct cached *c)
+{ // out of the cache, telling its query
+    struct cached **cp;
+    struct query *q;
+    _h_remove(d,c);
+    _c_unlink(d,c);
+    for(cp = &ATOM(c->rr.name)->owned; *cp != c; cp = &(*cp)->onext);
+    __atomic_store_n(cp, c->onext, __ATOMIC_RELEASE);
+    if(c->tnext) c->tnext->tprev = c->tprev;
+    if(c->tprev) c->tprev->tnext = c->tnext;
+    else d->types[c->rr.type % TYPES] = c->tnext;
+    if(c->rr.rdname)
+    {
+        if(c->rnext) c->rnext->rprev = c->rprev;
+        if(c->rprev) c->rprev->rnext = c->rnext;
+        else ATOM(c->rr.rdname)->targets = c->rnext;
+    }
+    d->cbytes -= _c_bytes(c->rr.name,c->rr.rdname,c->rr.rdlen);
+    if((q = c->q) != 0) q->busy++; // a watch can unsubscribe the last of its query's subscribers, it's swept after they hear
+    _w_answer(d,c);
+    if(q)
+    {
+        q->busy--;
+        _q_answer(d,c);
+    }
+    _c_free(d,c);
+}
+
+void _c_reap(mdnsd d)
+{ // expire everything that's due, soonest first
+    struct cached *c;
+    while((c = _h_first(d)) != 0 && d->now.tv_sec >= c->rr.ttl) _c_drop(d,c);
+}
+
+void _e_reclaim(mdnsd d, int all)
+{ // move the epoch on, and free what was retired before the oldest reader still in there came in (everything if all)
+    struct cached *c, **cp;
+    struct atom *a, **ap;
+    struct retired *t, **tp;
+    unsigned long int min, e;
+    int i;
+    if(d->lcached == 0 && d->latoms == 0 && d->ltables == 0) return;
+    min = __atomic_add_fetch(&d->epoch, 1, __ATOMIC_SEQ_CST);
+    if(all) min = ~0UL;
+    for(i = 0; i < READERS && !all; i++)
+        if((e = __atomic_load_n(&d->readers[i].epoch, __ATOMIC_SEQ_CST)) != 0 && e < min) min = e;
+    for(cp = &d->lcached; (c = *cp) != 0;)
+        if(c->at < min) { *cp = c->next; _c_release(d,c); }
+        else cp = &c->next;
+    for(ap = &d->latoms; (a = *ap) != 0;) // after the entries, which may have retired more
+        if(a->epoch < min) { *ap = a->limbo; _d_free(d,a); }
+        else ap = &a->limbo;
+    for(tp = &d->ltables; (t = *tp) != 0;)
+        if(t->epoch < min) { *tp = t->next; _d_free(d,t->ptr); _d_free(d,t); }
+        else tp = &t->next;
+}
+
+void _c_evict(mdnsd d, unsigned long int bytes)
+{ // make room for one more entry of this many bytes, whatever's soonest to expire and not wanted by a query goes first
+    struct cached *c;
+    while((d->cachemax && d->heap[0].count + d->heap[1].count >= d->cachemax) || (d->cachebytes && d->cbytes + bytes > d->cachebytes))
+    {
+        if(d->heap[0].count > 0) c = d->heap[0].e[0];
+        else if(d->heap[1].count > 0) c = d->heap[1].e[0];
+        else return;
+        _c_ttl(c,0); // it's gone as far as the query can tell
+        _c_drop(d,c);
+    }
+}
+
+void _c_add(mdnsd d, struct cached *c)
+{ // index a new entry, first under its name/type, and when it expires
+    struct cslot *s;
+    _ci_grow(d);
+    _atom_domain(d,ATOM(c->rr.name));
+    if((s = _ci_slot(&d->cold,c->rr.name,c->rr.type)) != 0) _ci_move(d,s); // a name/type only ever lives in one index
+    if((s = _ci_slot(&d->cache,c->rr.name,c->rr.type)) == 0) s = _ci_put(&d->cache,c->rr.name,c->rr.type,0);
+    c->next = s->list;
+    s->list = c;
+    c->onext = ATOM(c->rr.name)->owned;
+    __atomic_store_n(&ATOM(c->rr.name)->owned, c, __ATOMIC_RELEASE); // all of c is there for a reader to see first
+    if((c->tnext = d->types[c->rr.type % TYPES]) != 0) c->tnext->tprev = c;
+    d->types[c->rr.type % TYPES] = c;
+    if(c->rr.rdname)
+    {
+        if((c->rnext = ATOM(c->rr.rdname)->targets) != 0) c->rnext->rprev = c;
+        ATOM(c->rr.rdname)->targets = c;
+    }
+    d->cbytes += _c_bytes(c->rr.name,c->rr.rdname,c->rr.rdlen);
+    _h_push(d,c);
+}
+
+unsigned long int _rhash(struct resource *r, char *rdname)
+{ // what _a_match() compares, hashed, so only likely matches are compared in full
+    unsigned long int h = 2166136261UL;
+    int i;
+    if(rdname && (r->type == QTYPE_PTR || r->type == QTYPE_NS || r->type == QTYPE_CNAME)) return ATOM(rdname)->hash;
+    if(rdname && r->type == QTYPE_SRV) return ((ATOM(rdname)->hash * 31 + r->known.srv.port) * 31 + r->known.srv.weight) * 31 + r->known.srv.priority;
+    for(i = 0; i < r->rdlength; i++) h = (h ^ r->rdata[i]) * 16777619UL;
+    return h;
+}
+
+// the cached entry identical to r if there is one, name and rdname are r's as atoms and rhash its _rhash()
+struct cached *_c_find(mdnsd d, struct resource *r, char *name, char *rdname, unsigned long int rhash)
+{
+    struct cached *c = 0;
+    while(c = _c_next(d,c,name,r->type))
+        if(c->rhash == rhash && _a_match(r,name,rdname,&c->rr)) return c;
+    return 0;
+}
+
+void _c_new(mdnsd d, struct resource *r, char *name, char *rdname, unsigned long int rhash, unsigned long int ttl)
+{ // cache r until ttl (absolute), telling its query
+    struct cached *c;
+    struct query *q;
+    _c_evict(d,_c_bytes(name,rdname,r->rdlength));
+    c = (struct cached *)_p_get(d,&d->pcached);
+    c->rhash = rhash;
+    c->at = d->now.tv_sec;
+    c->rr.name = _atom_ref(name);
+    c->rr.type = r->type;
+    c->rr.ttl = ttl;
+    c->life = ttl > d->now.tv_sec ? ttl - d->now.tv_sec : 1;
+    _c_refresh(d,c);
+    c->rr.rdlen = r->rdlength;
+    c->rr.rdata = _rdata(d,c->small,r->rdlength);
+    memcpy(c->rr.rdata,r->rdata,r->rdlength);
+    switch(r->type)
+    {
+    case QTYPE_A:
+        c->rr.ip = r->known.a.ip;
+        break;
+    case QTYPE_NS:
+    case QTYPE_CNAME:
+    case QTYPE_PTR:
+        c->rr.rdname = _atom_ref(rdname);
+        break;
+    case QTYPE_SRV:
+        c->rr.rdname = _atom_ref(rdname);
+        c->rr.srv.port = r->known.srv.port;
+        c->rr.srv.weight = r->known.srv.weight;
+        c->rr.srv.priority = r->known.srv.priority;
+        break;
     }
+    c->q = q = _q_next(d, 0, name, r->type);
+    _c_add(d,c);
+    if(q) q->busy++; // same as in _c_drop
+    _w_answer(d,c);
+    if(q == 0) return; // or a watch asked for it just now, and that query's subscribers were handed c already
+    q->busy--;
+    _q_when(d,q,c);
+    _q_seen(d,q,0);
+    _q_answer(d,c);
 }
 
-// brute force expire any old cached records
-void _gc(mdnsd d)
-{
-    int i;
-    for(i=0;i<LPRIME;i++)
-        if(d->cache[i]) _c_expire(d,&d->cache[i]);
-    d->expireall = d->now.tv_sec + GC;
-}
-
-void _cache(mdnsd d, struct resource *r)
-{
+void _cache(mdnsd d, struct resource *r, char *name, char *rdname)
+{ // name and rdname are r's as atoms
     struct cached *c = 0;
-    int i = _namehash(r->name) % LPRIME;
+    unsigned long int rhash = _rhash(r,rdname);
 
     if(r->class == 32768 + d->class)
-    { // cache flush
-        while(c = _c_next(d,c,r->name,r->type)) c->rr.ttl = 0;
-        _c_expire(d,&d->cache[i]);
+    { // cache flush, anything else not heard from within the last second goes in one (rfc6762 section 10.2)
+        while(c = _c_next(d,c,name,r->type))
+        {
+            if(c->at == d->now.tv_sec || (c->rhash == rhash && _a_match(r,name,rdname,&c->rr))) continue;
+            if(c->rr.ttl <= d->now.tv_sec + 1) continue;
+            _c_ttl(c,d->now.tv_sec + 1);
+            _h_fix(d,c);
+        }
     }
 
     if(r->ttl == 0)
     { // process deletes
-        while(c = _c_next(d,c,r->name,r->type))
-            if(_a_match(r,&c->rr))
+        while(c = _c_next(d,c,name,r->type))
+            if(c->rhash == rhash && _a_match(r,name,rdname,&c->rr))
             {
-                c->rr.ttl = 0;
-                _c_expire(d,&d->cache[i]);
+                _c_ttl(c,0);
+                _h_fix(d,c);
             }
+        _c_reap(d);
         return;
     }
 
-    c = (struct cached *)malloc(sizeof(struct cached));
-    bzero(c,sizeof(struct cached));
-    c->rr.name = strdup(r->name);
-    c->rr.type = r->type;
-    c->rr.ttl = d->now.tv_sec + (r->ttl / 2) + 8; // XXX hack for now, BAD SPEC, start retrying just after half-waypoint, then expire
-    c->rr.rdlen = r->rdlength;
-    c->rr.rdata = (unsigned char *)malloc(r->rdlength);
-    memcpy(c->rr.rdata,r->rdata,r->rdlength);
+    if((c = _c_find(d,r,name,rdname,rhash)) != 0)
+    { // already have it, only the ttl is new and nobody needs to hear about that
+        _c_ttl(c,d->now.tv_sec + r->ttl);
+        c->at = d->now.tv_sec;
+        c->life = r->ttl;
+        c->rstep = 0;
+        _c_refresh(d,c);
+        if(c->q) _q_when(d,c->q,c);
+        if(c->q) _q_seen(d,c->q,0);
+        _h_fix(d,c);
+        return;
+    }
+
+    _c_new(d,r,name,rdname,rhash,d->now.tv_sec + r->ttl);
+}
+
+int _valid(mdnsd d, struct resource *r)
+{ // worth caching at all, our class and what its type needs to be usable
+    if((r->class & 32767) != d->class || r->name == 0 || *r->name == 0) return 0;
     switch(r->type)
     {
     case QTYPE_A:
-        c->rr.ip = r->known.a.ip;
-        break;
+        return r->rdlength == 4;
     case QTYPE_NS:
     case QTYPE_CNAME:
     case QTYPE_PTR:
-        c->rr.rdname = strdup(r->known.ns.name);
-        break;
     case QTYPE_SRV:
-        c->rr.rdname = strdup(r->known.srv.name);
-        c->rr.srv.port = r->known.srv.port;
-        c->rr.srv.weight = r->known.srv.weight;
-        c->rr.srv.priority = r->known.srv.priority;
-        break;
+        return _rr_rdname(r) != 0 && *_rr_rdname(r) != 0;
     }
-    c->next = d->cache[i];
-    d->cache[i] = c;
-    if(c->q = _q_next(d, 0, r->name, r->type))
-        _q_answer(d,c);
+    return 1;
+}
+
+void _answer(mdnsd d, struct resource *r)
+{ // process an incoming answer (or authority/additional record), check for a conflict, and cache
+    mdnsdr cur;
+    char *name, *rdname;
+    if(!_valid(d,r)) return;
+    name = _atom(d,r->name);
+    rdname = _atom(d,_rr_rdname(r));
+    if((cur = _r_next(d,0,name,r->type)) != 0 && cur->unique && _a_match(r,name,rdname,&cur->rr) == 0) _conflict(d,cur);
+    _cache(d,r,name,rdname);
+    _atom_free(d,name);
+    _atom_free(d,rdname);
+}
+
+char **_known(mdnsd d, struct message *m)
+{ // the atoms for each known answer's name and rdname (0 if none, so nothing of ours can match), found once per message
+    int i;
+    if(m->ancount * 2 > d->knownsize)
+    {
+        d->known = (char **)_d_grow(d, d->known, 0, sizeof(char *) * m->ancount * 2);
+        d->knownsize = m->ancount * 2;
+    }
+    for(i = 0; i < m->ancount; i++)
+    {
+        d->known[i * 2] = _atom_find(d,m->an[i].name);
+        d->known[i * 2 + 1] = _atom_find(d,_rr_rdname(&m->an[i]));
+    }
+    return d->known;
 }
 
 void _a_copy(struct message *m, mdnsda a)
-{ // copy the data bits only
+{ // copy the data bits only, names first since cached rdata may hold compression pointers into the packet it came from
+    if(a->rdname && a->type == QTYPE_SRV) { message_rdata_srv(m, a->srv.priority, a->srv.weight, a->srv.port, a->rdname); return; }
+    if(a->rdname) { message_rdata_name(m, a->rdname); return; }
     if(a->rdata) { message_rdata_raw(m, a->rdata, a->rdlen); return; }
     if(a->ip) message_rdata_long(m, a->ip);
-    if(a->type == QTYPE_SRV) message_rdata_srv(m, a->srv.priority, a->srv.weight, a->srv.port, a->rdname);
-    else if(a->rdname) message_rdata_name(m, a->rdname);
+}
+
+void _q_heard(mdnsd d, struct message *m, char **known)
+{ // check each question for one of ours, as long as every known answer with it is one we'd list too
+    struct query *q;
+    struct cached *c;
+    char *name;
+    int i, j;
+    for(i=0;i<m->qdcount;i++)
+    {
+        if(m->qd[i].class != d->class || (name = _atom_find(d,m->qd[i].name)) == 0 || (q = _q_next(d,0,name,m->qd[i].type)) == 0) continue;
+        for(j=0;j<m->ancount;j++)
+        {
+            if(known[j * 2] != name || m->an[j].type != q->type) continue;
+            c = _c_find(d,&m->an[j],name,known[j * 2 + 1],_rhash(&m->an[j],known[j * 2 + 1]));
+            if(c == 0 || c->rr.ttl <= d->now.tv_sec + c->life / 2) break; // they know one we don't, the answers they get may not be all of ours
+        }
+        if(j == m->ancount) _q_seen(d,q,1);
+    }
+}
+
+int _q_known(mdnsd d, struct message *m)
+{ // append the known answers still owed for the last questions, returns 1 if the rest have to spill into another packet
+    struct query *q;
+    struct cached *c;
+    int i;
+    while((q = d->asked) != 0)
+    {
+        for(c = 0, i = 1; (c = _c_next(d,c,q->name,q->type)) != 0;)
+        { // only ones with more than half their ttl left (rfc6762 section 7.1)
+            if(c->rr.ttl <= d->now.tv_sec + c->life / 2 || i++ < q->known) continue;
+            if(message_packet_len(m) + _rr_len(&c->rr) <= MAX_PACKET_LEN)
+            { // exact fit, try it and undo if the frame overflowed
+                message_mark(m);
+                message_an(m,q->name,q->type,d->class,c->rr.ttl - d->now.tv_sec);
+                _a_copy(m,&c->rr);
+                if(message_packet_len(m) <= d->frame) { q->known = i; continue; }
+                message_rollback(m);
+            }
+            if(m->qdcount > 0 || m->ancount > 0) return 1;
+            q->known = i; // can't fit even alone, skip it
+        }
+        q->known = 0;
+        d->asked = q->list;
+    }
+    return 0;
+}
+
+void _r_sent(mdnsd d, mdnsdr r)
+{ // in the answer being built, remembered to add what goes with it after
+    if(d->nsent == d->sentsize)
+    {
+        d->sentsize = d->sentsize ? d->sentsize * 2 : 16;
+        d->sent = (mdnsdr *)_d_grow(d, d->sent, sizeof(mdnsdr) * d->nsent, sizeof(mdnsdr) * d->sentsize);
+    }
+    d->sent[d->nsent++] = r;
 }
 
 int _r_out(mdnsd d, struct message *m, mdnsdr *list)
 { // copy a published record into an outgoing message
     mdnsdr r, next;
     int ret = 0;
-    while((r = *list) != 0 && message_packet_len(m) + _rr_len(&r->rr) < d->frame)
+    while((r = *list) != 0)
     {
-        *list = r->list;
+        if(!_r_an(d,m,r) && message_packet_len(m) > 12) break;
+        *list = r->list; // (dropped if it can't fit even alone)
         ret++;
-        if(r->unique)
-            message_an(m, r->rr.name, r->rr.type, d->class + 32768, r->rr.ttl);
-        else
-            message_an(m, r->rr.name, r->rr.type, d->class, r->rr.ttl);
-        _a_copy(m, &r->rr);
         if(r->rr.ttl == 0) _r_done(d,r);
+        else _r_sent(d,r);
     }
     return ret;
 }
 
 
+struct negative *_n_find(mdnsd d, char *name, int type)
+{
+    struct negative *n;
+    for(n = d->negatives[ATOM(name)->hash % SPRIME]; n != 0; n = n->next)
+        if(n->name == name && n->type == type && timercmp(&n->until,&d->now,>)) return n;
+    return 0;
+}
+void _n_add(mdnsd d, char *name, int type)
+{ // remember a miss
+    struct negative *n;
+    int i = ATOM(name)->hash % SPRIME;
+    if(d->negative <= 0 || _n_find(d,name,type) != 0) return;
+    n = (struct negative *)_d_alloc(d,sizeof(struct negative));
+    n->name = _atom_ref(name);
+    n->type = type;
+    n->until = d->now;
+    n->until.tv_sec += d->negative / 1000;
+    if((n->until.tv_usec += (d->negative % 1000) * 1000) >= 1000000)
+    {
+        n->until.tv_sec++;
+        n->until.tv_usec -= 1000000;
+    }
+    n->next = d->negatives[i];
+    d->negatives[i] = n;
+    n->after = 0;
+    if(d->nlast) d->nlast->after = n;
+    else d->nfirst = n;
+    d->nlast = n;
+}
+void _n_expire(mdnsd d, int all)
+{ // forget the misses that are due (or all of them)
+    struct negative *n, **np;
+    while((n = d->nfirst) != 0 && (all || !timercmp(&n->until,&d->now,>)))
+    {
+        for(np = &d->negatives[ATOM(n->name)->hash % SPRIME]; *np != n; np = &(*np)->next);
+        *np = n->next;
+        if((d->nfirst = n->after) == 0) d->nlast = 0;
+        _atom_free(d,n->name);
+        _d_free(d,n);
+    }
+}
+
+int _nsec_denies(mdnsda a, int type)
+{ // whether an NSEC says its name has no records of type (rfc6762 section 6.1), past the next name it's the type bitmaps
+    unsigned char *p = a->rdata, *end = a->rdata + a->rdlen;
+    int window, len, i = (type & 255) / 8;
+    if(type == 255) return 0;
+    while(p < end && *p != 0 && (*p & 0xc0) == 0) p += *p + 1;
+    p += (p < end && (*p & 0xc0)) ? 2 : 1;
+    while(p + 2 <= end)
+    {
+        window = p[0];
+        len = p[1];
+        p += 2;
+        if(window == type >> 8) return i >= len || p + i >= end || (p[i] & (0x80 >> (type & 7))) == 0;
+        p += len;
+    }
+    return 1;
+}
+
+void _v_end(struct mdnsdq_struct *v)
+{ // out of the list and not following anything anymore, freed unless it's still being set up
+    mdnsd d = v->d;
+    struct mdnsdq_struct **vp;
+    v->done = 0;
+    for(vp = &d->resolves; *vp != v; vp = &(*vp)->next);
+    *vp = v->next;
+    if(v->s && v->s->answer) _s_drop(d,v->s);
+    if(v->nsec && v->nsec->answer) _w_drop(d,v->nsec);
+    v->s = 0;
+    v->nsec = 0;
+    if(v->busy) return;
+    _atom_free(d,v->name);
+    _d_free(d,v);
+}
+void _v_done(struct mdnsdq_struct *v, mdnsda a)
+{ // tell it, just the once
+    void (*done)(mdnsda, void *) = v->done;
+    void *arg = v->arg;
+    if(done == 0) return;
+    _v_end(v);
+    done(a,arg);
+}
+int _v_answer(mdnsda a, void *arg)
+{
+    if(a->ttl != 0) _v_done((struct mdnsdq_struct *)arg,a);
+    return 0;
+}
+int _v_nsec(mdnsda a, void *arg)
+{
+    struct mdnsdq_struct *v = (struct mdnsdq_struct *)arg;
+    if(a->ttl != 0 && (char *)a->name == v->name && _nsec_denies(a,v->type)) _v_done(v,0);
+    return 0;
+}
+void _v_expire(mdnsd d)
+{ // fail whatever's past its deadline, and remember that
+    struct mdnsdq_struct *v;
+    while((v = d->resolves) != 0 && !timercmp(&v->deadline,&d->now,>))
+    {
+        _n_add(d,v->name,v->type);
+        _v_done(v,0);
+    }
+}
+void _s_until(mdnsd d, long int usec)
+{ // mdnsd_sleep() no longer than usec from now (none if that's past)
+    if(usec < 0) usec = 0;
+    if(usec >= (long int)d->sleep.tv_sec * 1000000 + d->sleep.tv_usec) return;
+    d->sleep.tv_sec = usec / 1000000;
+    d->sleep.tv_usec = usec % 1000000;
+}
+
+void _v_sleep(mdnsd d)
+{ // mdnsd_sleep() no later than the first deadline
+    if(d->resolves == 0) return;
+    _s_until(d,(long int)(d->resolves->deadline.tv_sec - d->now.tv_sec) * 1000000 + d->resolves->deadline.tv_usec - d->now.tv_usec);
+}
+
 mdnsd mdnsd_new(int class, int frame)
 {
-    int i;
+    struct mdnsd_config config;
+    bzero(&config,sizeof(struct mdnsd_config));
+    config.class = class;
+    config.frame = frame;
+    return mdnsd_new_config(&config);
+}
+
+mdnsd mdnsd_new_config(struct mdnsd_config *config)
+{
+    int size;
     mdnsd d;
-    d = (mdnsd)malloc(sizeof(struct mdnsd_struct));
+    if(config->alloc && config->free) d = (mdnsd)config->alloc(config->arg,sizeof(struct mdnsd_struct));
+    else d = (mdnsd)malloc(sizeof(struct mdnsd_struct));
     bzero(d,sizeof(struct mdnsd_struct));
+    if(config->alloc && config->free)
+    {
+        d->alloc = config->alloc;
+        d->free = config->free;
+        d->arg = config->arg;
+    }
+    _p_init(&d->pcached,sizeof(struct cached));
+    _p_init(&d->pquery,sizeof(struct query));
+    _p_init(&d->psub,sizeof(struct mdnsds_struct));
+    _p_init(&d->punicast,sizeof(struct unicast));
+    _p_init(&d->precord,sizeof(struct mdnsdr_struct));
     gettimeofday(&d->now,0);
-    d->expireall = d->now.tv_sec + GC;
-    d->class = class;
-    d->frame = frame;
+    d->class = config->class ? config->class : 1;
+    d->frame = config->frame > 0 && config->frame < MAX_PACKET_LEN ? config->frame : MAX_PACKET_LEN;
+    d->cachemax = config->cachemax > 0 ? config->cachemax : 0;
+    d->cachebytes = config->cachebytes;
+    d->negative = config->negative ? config->negative : NEGATIVE;
+    for(size = 16; size * 3 < (config->cache > 0 ? config->cache : CACHE) * 4; size *= 2); // a power of 2, under 3/4 full at that many
+    _ci_init(d,&d->cache,size);
+    d->in = (struct message *)_d_alloc(d,sizeof(struct message));
+    bzero(d->in,sizeof(struct message));
+    d->out = (struct message *)_d_alloc(d,sizeof(struct message));
+    bzero(d->out,sizeof(struct message));
+    d->seed = d->now.tv_sec ^ d->now.tv_usec << 12 ^ (unsigned long int)d;
+    if(d->seed == 0) d->seed = 1;
+    d->epoch = 1; // a reader slot is free at 0
+    d->atomsize = ATOMS;
+    d->atoms = (struct atom **)_d_alloc(d,sizeof(struct atom *) * ATOMS);
+    bzero(d->atoms,sizeof(struct atom *) * ATOMS);
     return d;
 }
 
@@ -388,6 +1951,8 @@ void mdnsd_shutdown(mdnsd d)
             d->a_now = cur;
             cur = next;
         }
+    while(d->responses) _rc_free(d,d->responses);
+    while(d->truncated) _tc_free(d,d->truncated,0);
     d->shutdown = 1;
 }
 
@@ -399,59 +1964,156 @@ void mdnsd_flush(mdnsd d)
     // reset all answer lists
 }
 
+void _ci_free(mdnsd d, struct cindex *t)
+{ // every entry still in t, then t
+    struct cached *c, *next;
+    int i;
+    for(i = 0; i < t->size; i++)
+        if(t->slots[i].name != 0 && t->slots[i].name != TOMB)
+            for(c = t->slots[i].list; c != 0; c = next)
+            {
+                next = c->next;
+                _c_free(d,c);
+            }
+    _d_free(d,t->slots);
+}
+
 void mdnsd_free(mdnsd d)
 {
+    struct query *q;
+    mdnsdr r;
+    void (*dfree)(void *, void *) = d->alloc ? d->free : 0;
+    void *arg = d->arg;
     int i;
-    // loop through all hashes, free everything
-    // free answers if any
-    free(d);
+    while(d->responses) _rc_free(d,d->responses);
+    while(d->truncated) _tc_free(d,d->truncated,0);
+    while(d->browses) _b_free(d,d->browses); // their subscriptions go with the queries
+    while(d->resolves) _v_end(d->resolves); // their subscriptions go with the queries
+    _n_expire(d,1);
+    while(d->watches) _w_free(d,d->watches);
+    for(i = 0; i < SPRIME; i++)
+    {
+        while((q = d->queries[i]) != 0) _q_done(d,q);
+        while((r = d->published[i]) != 0) _r_done(d,r);
+    }
+    _ci_free(d,&d->cache);
+    _ci_free(d,&d->cold);
+    _e_reclaim(d,1); // there can't be any readers left by now
+    // the nodes themselves (and any unicast answers left) all go with their slabs
+    _p_free(d,&d->pcached);
+    _p_free(d,&d->pquery);
+    _p_free(d,&d->psub);
+    _p_free(d,&d->punicast);
+    _p_free(d,&d->precord);
+    _d_free(d,d->heap[0].e);
+    _d_free(d,d->heap[1].e);
+    _d_free(d,d->known);
+    _d_free(d,d->qheap);
+    _d_free(d,d->sent);
+    _d_free(d,d->atoms);
+    _d_free(d,d->in);
+    _d_free(d,d->out);
+    if(dfree) dfree(arg,d);
+    else free(d);
 }
 
 void mdnsd_in(mdnsd d, struct message *m, unsigned long int ip, unsigned short int port)
 {
     int i, j;
     mdnsdr r = 0;
+    struct truncated *t = 0;
+    char *name, **known;
 
     if(d->shutdown) return;
 
     gettimeofday(&d->now,0);
+    _c_reap(d);
+    _e_reclaim(d,0);
 
     if(m->header.qr == 0)
     {
+        // a TC query holds its answers a while, the rest of its known answers can follow in more packets
+        known = _known(d,m);
+        for(i=0;i<m->ancount;i++) // remember which of ours they've got, so they aren't added as additional records unless someone else needs them
+            for(r = 0; known[i * 2] && (r = _r_next(d,r,known[i * 2],m->an[i].type)) != 0;)
+                if(_a_match(&m->an[i],known[i * 2],known[i * 2 + 1],&r->rr) && d->now.tv_sec - r->wanted > 1) r->known = d->now.tv_sec;
+        r = 0;
+        if(port == htons(5353) && (t = _tc_find(d,ip,port)) == 0 && m->header.tc) t = _tc_new(d,ip,port);
+        if(t) _tc_known(t,m,known);
+
+        // other queriers asking what we would, ours can wait
+        if(port == htons(5353) && !m->header.tc) _q_heard(d,m,known);
+
+        // plain multicast questions w/o known answers can usually be answered from the response cache
+        if(t == 0 && port == htons(5353) && m->ancount == 0 && m->nscount == 0 && _rc_answer(d,m)) return;
+
         for(i=0;i<m->qdcount;i++)
         { // process each query
-            if(m->qd[i].class != d->class || (r = _r_next(d,0,m->qd[i].name,m->qd[i].type)) == 0) continue;
+            if(m->qd[i].class != d->class || (name = _atom_find(d,m->qd[i].name)) == 0 || (r = _r_next(d,0,name,m->qd[i].type)) == 0) continue;
 
             // send the matching unicast reply
-            if(port != 5353) _u_push(d,r,m->id,ip,port);
+            if(port != htons(5353)) _u_push(d,r,m->id,ip,port);
 
-            for(;r != 0; r = _r_next(d,r,m->qd[i].name,m->qd[i].type))
+            for(;r != 0; r = _r_next(d,r,name,m->qd[i].type))
             { // check all of our potential answers
                 if(r->unique && r->unique < 5)
                 { // probing state, check for conflicts
                     for(j=0;j<m->nscount;j++)
                     { // check all to-be answers against our own
-                        if(m->qd[i].type != m->an[j].type || strcmp(m->qd[i].name,m->an[j].name)) continue;
-                        if(!_a_match(&m->an[j],&r->rr)) _conflict(d,r); // this answer isn't ours, conflict!
+                        if(m->qd[i].type != m->ns[j].type || _atom_find(d,m->ns[j].name) != name) continue;
+                        if(!_a_match(&m->ns[j],name,_atom_find(d,_rr_rdname(&m->ns[j])),&r->rr)) _conflict(d,r); // this answer isn't ours, conflict!
                     }
                     continue;
                 }
-                for(j=0;j<m->ancount;j++)
-                { // check the known answers for this question
-                    if(m->qd[i].type != m->an[j].type || strcmp(m->qd[i].name,m->an[j].name)) continue;
-                    if(_a_match(&m->an[j],&r->rr)) break; // they already have this answer
-                }
-                if(j == m->ancount) _r_send(d,r);
+                for(j=0;j<m->ancount;j++) // check the known answers for this question
+                    if(_a_match(&m->an[j],known[j * 2],known[j * 2 + 1],&r->rr)) break; // they already have this answer
+                if(j < m->ancount) continue;
+                _r_needed(d,r,m,known);
+                if(t) _tc_add(d,t,r);
+                else _r_send(d,r);
             }
         }
         return;
     }
 
+    // the other sections are as good as answers, usually the SRV/TXT/A that go with a PTR
     for(i=0;i<m->ancount;i++)
-    { // process each answer, check for a conflict, and cache
-        if((r = _r_next(d,0,m->an[i].name,m->an[i].type)) != 0 && r->unique && _a_match(&m->an[i],&r->rr) == 0) _conflict(d,r);
-        _cache(d,&m->an[i]);
+        _answer(d,&m->an[i]);
+    for(i=0;i<m->nscount;i++)
+        _answer(d,&m->ns[i]);
+    for(i=0;i<m->arcount;i++)
+        _answer(d,&m->ar[i]);
+}
+
+void mdnsd_in_packet(mdnsd d, unsigned char *packet, int len, unsigned long int ip, unsigned short int port)
+{
+    struct mview v;
+    struct question q;
+    struct resource rr;
+    unsigned char names[512];
+    char *name;
+    int i;
+
+    if(d->shutdown || !message_view(&v,packet,len)) return;
+
+    if(v.header.qr == 0)
+    { // only worth a full parse if one of the questions is for us, or one we're asking too
+        for(i=0;i<v.qdcount;i++)
+            if(mview_qd(&v,i,&q,names) && q.class == d->class && (name = _atom_find(d,q.name)) != 0 && (_r_next(d,0,name,q.type) || _q_next(d,0,name,q.type))) break;
+        if(i == v.qdcount && _tc_find(d,ip,port) == 0) return;
+        bzero(packet + len, MAX_PACKET_LEN - len);
+        message_parse(d->in,packet);
+        mdnsd_in(d,d->in,ip,port);
+        return;
     }
+
+    gettimeofday(&d->now,0);
+    _c_reap(d);
+    _e_reclaim(d,0);
+
+    for(i=0;i<v.ancount + v.nscount + v.arcount;i++)
+        if(mview_rr(&v,i,&rr,names))
+            _answer(d,&rr);
 }
 
 int mdnsd_out(mdnsd d, struct message *m, unsigned long int *ip, unsigned short int *port)
@@ -460,7 +2122,12 @@ int mdnsd_out(mdnsd d, struct message *m, unsigned long int *ip, unsigned short
     int ret = 0;
 
     gettimeofday(&d->now,0);
-    bzero(m,sizeof(struct message));
+    _c_reap(d);
+    _v_expire(d);
+    _n_expire(d,0);
+    _e_reclaim(d,0);
+    message_reset(m);
+    d->nsent = 0;
 
     // defaults, multicast
     *port = htons(5353);
@@ -475,13 +2142,36 @@ int mdnsd_out(mdnsd d, struct message *m, unsigned long int *ip, unsigned short
         *port = u->port;
         *ip = u->to;
         m->id = u->id;
-        message_qd(m, u->r->rr.name, u->r->rr.type, d->class);
-        message_an(m, u->r->rr.name, u->r->rr.type, d->class, u->r->rr.ttl);
-        _a_copy(m, &u->r->rr);
-        free(u);
+        message_qd_enc(m, u->r->wname, u->r->rr.type, d->class);
+        message_an_enc(m, u->r->wname, u->r->rr.type, d->class, u->r->rr.ttl);
+        _r_rdata(m, u->r);
+        _r_extra(d,m,&u->r,1,0,1);
+        _p_put(&d->punicast,u);
         return 1;
     }
 
+    if(d->rsend)
+    { // send out any ready-made response that's due
+        struct response *rc, *last = 0;
+        for(rc = d->rsend; rc != 0 && _tvdiff(d->now,rc->at) > 0; last = rc, rc = rc->list);
+        if(rc != 0)
+        {
+            if(last) last->list = rc->list;
+            else d->rsend = rc->list;
+            rc->pending = 0;
+            message_load(m, rc->packet, rc->len);
+            return 1;
+        }
+    }
+
+    while(d->truncated)
+    { // held TC answers whose wait is over go out the usual way now
+        struct truncated *t;
+        for(t = d->truncated; t != 0 && _tvdiff(d->now,t->at) > 0; t = t->next);
+        if(t == 0) break;
+        _tc_free(d,t,1);
+    }
+
 //printf("OUT: probing %X now %X pause %X publish %X\n",d->probing,d->a_now,d->a_pause,d->a_publish);
 
     // accumulate any immediate responses
@@ -490,15 +2180,12 @@ int mdnsd_out(mdnsd d, struct message *m, unsigned long int *ip, unsigned short
     if(d->a_publish && _tvdiff(d->now,d->publish) <= 0)
     { // check to see if it's time to send the publish retries (and unlink if done)
         mdnsdr next, cur = d->a_publish, last = 0;
-        while(cur && message_packet_len(m) + _rr_len(&cur->rr) < d->frame)
+        while(cur)
         {
             next = cur->list;
+            if(!_r_an(d,m,cur) && message_packet_len(m) > 12) break;
             ret++; cur->tries++;
-            if(cur->unique)
-                message_an(m, cur->rr.name, cur->rr.type, d->class + 32768, cur->rr.ttl);
-            else
-                message_an(m, cur->rr.name, cur->rr.type, d->class, cur->rr.ttl);
-            _a_copy(m, &cur->rr);
+            if(cur->rr.ttl != 0) _r_sent(d,cur);
             if(cur->rr.ttl != 0 && cur->tries < 4)
             {
                 last = cur;
@@ -524,10 +2211,21 @@ int mdnsd_out(mdnsd d, struct message *m, unsigned long int *ip, unsigned short
     if(d->a_pause && _tvdiff(d->now, d->pause) <= 0) ret += _r_out(d, m, &d->a_pause);
 
     // now process questions
-    if(ret) return ret;
+    if(ret)
+    {
+        _r_extra(d,m,d->sent,d->nsent,0,1);
+        return ret;
+    }
     m->header.qr = 0;
     m->header.aa = 0;
 
+    if(d->spill)
+    { // rest of the known answers for the last questions, TC stays set until they're all out
+        d->spill = _q_known(d,m);
+        m->header.tc = d->spill;
+        if(m->ancount) return 1;
+    }
+
     if(d->probing && _tvdiff(d->now,d->probe) <= 0)
     {
         mdnsdr last = 0;
@@ -546,15 +2244,15 @@ int mdnsd_out(mdnsd d, struct message *m, unsigned long int *ip, unsigned short
                 r = next;
                 continue;
             }
-            message_qd(m, r->rr.name, r->rr.type, d->class);
+            message_qd_enc(m, r->wname, r->rr.type, d->class);
             last = r;
             r = r->list;
         }
         for(r = d->probing; r != 0; last = r, r = r->list)
         { // scan probe list again to append our to-be answers
             r->unique++;
-            message_ns(m, r->rr.name, r->rr.type, d->class, r->rr.ttl);
-            _a_copy(m, &r->rr);
+            message_ns_enc(m, r->wname, r->rr.type, d->class, r->rr.ttl);
+            _r_rdata(m, r);
             ret++;
         }
         if(ret)
@@ -565,46 +2263,27 @@ int mdnsd_out(mdnsd d, struct message *m, unsigned long int *ip, unsigned short
         }
     }
 
-    if(d->checkqlist && d->now.tv_sec >= d->checkqlist)
-    { // process qlist for retries or expirations
-        struct query *q;
-        struct cached *c;
-        unsigned long int nextbest = 0;
-
-        // ask questions first, track nextbest time
-        for(q = d->qlist; q != 0; q = q->list)
-            if(q->nexttry > 0 && q->nexttry <= d->now.tv_sec && q->tries < 3)
-                message_qd(m,q->name,q->type,d->class);
-            else if(q->nexttry > 0 && (nextbest == 0 || q->nexttry < nextbest))
-                nextbest = q->nexttry;
-
-        // include known answers, update questions
-        for(q = d->qlist; q != 0; q = q->list)
-        {
-            if(q->nexttry == 0 || q->nexttry > d->now.tv_sec) continue;
-            if(q->tries == 3)
-            { // done retrying, expire and reset
-                _c_expire(d,&d->cache[_namehash(q->name) % LPRIME]);
-                _q_reset(d,q);
-                continue;
-            }
-            ret++;
-            q->nexttry = d->now.tv_sec + ++q->tries;
-            if(nextbest == 0 || q->nexttry < nextbest)
-                nextbest = q->nexttry;
-            // if room, add all known good entries
-            c = 0;
-            while((c = _c_next(d,c,q->name,q->type)) != 0 && c->rr.ttl > d->now.tv_sec + 8 && message_packet_len(m) + _rr_len(&c->rr) < d->frame)
-            {
-                message_an(m,q->name,q->type,d->class,c->rr.ttl - d->now.tv_sec);
-                _a_copy(m,&c->rr);
-            }
+    while(d->qcount > 0 && _tvcmp(d->qheap[0]->nexttry,d->now) <= 0)
+    { // ask whatever is due, backing off or to refresh answers, any that don't fit go next time
+        struct query *q = d->qheap[0];
+        if(message_packet_len(m) + strlen(q->name) + 6 > d->frame) break;
+        if(!_q_due(d,q)) continue;
+        message_qd(m,q->name,q->type,d->class);
+        ret++;
+        if(q->known == 0)
+        { // owes all its known good entries
+            q->list = d->asked;
+            d->asked = q;
         }
-        d->checkqlist = nextbest;
+        q->known = 1;
     }
 
-    if(d->now.tv_sec > d->expireall)
-        _gc(d);
+    // add known answers, whatever doesn't fit sets TC and follows in more packets
+    if(ret)
+    {
+        d->spill = _q_known(d,m);
+        m->header.tc = d->spill;
+    }
 
     return ret;
 }
@@ -613,84 +2292,577 @@ struct timeval *mdnsd_sleep(mdnsd d)
 {
     int sec, usec;
     mdnsdr r;
+    struct cached *c;
+    struct response *rc;
+    struct truncated *t;
     d->sleep.tv_sec = d->sleep.tv_usec = 0;
-    #define RET while(d->sleep.tv_usec > 1000000) {d->sleep.tv_sec++;d->sleep.tv_usec -= 1000000;} return &d->sleep;
+    #define RET _v_sleep(d); while(d->sleep.tv_usec > 1000000) {d->sleep.tv_sec++;d->sleep.tv_usec -= 1000000;} return &d->sleep;
 
     // first check for any immediate items to handle
-    if(d->uanswers || d->a_now) return &d->sleep;
+    if(d->uanswers || d->a_now || d->spill) return &d->sleep;
 
     gettimeofday(&d->now,0);
 
-    if(d->a_pause)
-    { // then check for paused answers
-        if((usec = _tvdiff(d->now,d->pause)) > 0) d->sleep.tv_usec = usec;
-        RET;
+    // the sooner of query retries and the next cached entry to expire, if there's either
+    sec = IDLE;
+    usec = 0;
+    if(d->qcount > 0 && (long int)(d->qheap[0]->nexttry.tv_sec - d->now.tv_sec) < sec)
+    { // queries to the usec
+        sec = d->qheap[0]->nexttry.tv_sec - d->now.tv_sec;
+        usec = d->qheap[0]->nexttry.tv_usec - d->now.tv_usec;
+        if(usec < 0) { sec--; usec += 1000000; }
     }
+    if((c = _h_first(d)) != 0 && (long int)(c->rr.ttl - d->now.tv_sec) < sec) { sec = c->rr.ttl - d->now.tv_sec; usec = 0; }
+    if(sec >= 0) { d->sleep.tv_sec = sec; d->sleep.tv_usec = usec; }
+
+    // or whichever short timer is sooner, none of them can wait on another
+    for(rc = d->rsend; rc != 0; rc = rc->list) _s_until(d,_tvdiff(d->now,rc->at)); // ready-made responses
+    for(t = d->truncated; t != 0; t = t->next) _s_until(d,_tvdiff(d->now,t->at)); // held TC answers
+    if(d->a_pause) _s_until(d,_tvdiff(d->now,d->pause)); // paused answers
+    if(d->probing) _s_until(d,_tvdiff(d->now,d->probe)); // probe retries
+    if(d->a_publish) _s_until(d,_tvdiff(d->now,d->publish)); // publish retries
+    RET;
+}
 
-    if(d->probing)
-    { // now check for probe retries
-        if((usec = _tvdiff(d->now,d->probe)) > 0) d->sleep.tv_usec = usec;
-        RET;
+struct query *_q_new(mdnsd d, char *host, int type)
+{
+    struct query *q = (struct query *)_p_get(d,&d->pquery);
+    struct cached *cur = 0;
+    int i;
+    q->name = _atom(d,host);
+    q->type = type;
+    i = ATOM(q->name)->hash % SPRIME;
+    q->next = d->queries[i];
+    d->queries[i] = q;
+    q->nexttry = q->ask = d->now; // new question, immediately send out
+    q->interval = 1;
+    _qh_push(d,q);
+    while(cur = _c_next(d,cur,q->name,q->type))
+        _c_query(d,cur,q); // any cached entries should be associated
+    return q;
+}
+void mdnsd_query(mdnsd d, char *host, int type, int (*answer)(mdnsda a, void *arg), void *arg)
+{
+    struct query *q = 0;
+    mdnsds s;
+    char *name = _atom_find(d,host);
+    if(name != 0 && (q = _q_next(d,0,name,type)) != 0 && q->own != 0)
+    {
+        if(!answer) _s_drop(d,q->own); // no answer means we don't care anymore
+        else {
+            q->own->answer = answer;
+            q->own->arg = arg;
+        }
+        return;
     }
+    if(!answer) return;
+    if((s = mdnsd_subscribe(d,host,type,answer,arg)) != 0) s->q->own = s;
+}
+mdnsds mdnsd_subscribe(mdnsd d, char *host, int type, int (*answer)(mdnsda a, void *arg), void *arg)
+{
+    struct query *q = 0;
+    struct cached *cur = 0;
+    mdnsds s;
+    char *name = _atom_find(d,host);
+    if(!answer) return 0;
+    if(name == 0 || (q = _q_next(d,0,name,type)) == 0) q = _q_new(d,host,type);
+    s = (mdnsds)_p_get(d,&d->psub);
+    s->q = q;
+    s->answer = answer;
+    s->arg = arg;
+    s->next = q->subs;
+    q->subs = s;
+    // whatever's cached already (maybe from a snapshot) answers it right away, it's still asked on the network to refresh them
+    q->busy++;
+    while(s->answer && (cur = _c_next(d,cur,q->name,q->type)))
+        if(cur->rr.ttl > d->now.tv_sec && answer(&cur->rr,arg) == -1) _s_drop(d,s);
+    if(s->answer == 0) s = 0;
+    if(--q->busy == 0) _q_sweep(d,q);
+    return s;
+}
+void mdnsd_unsubscribe(mdnsd d, mdnsds s)
+{
+    if(s != 0 && s->answer != 0) _s_drop(d,s);
+}
 
-    if(d->a_publish)
-    { // now check for publish retries
-        if((usec = _tvdiff(d->now,d->publish)) > 0) d->sleep.tv_usec = usec;
-        RET;
+void _i_done(mdnsd d, struct instance *i)
+{ // stop following it
+    mdnsd_unsubscribe(d,i->srv);
+    mdnsd_unsubscribe(d,i->txt);
+    mdnsd_unsubscribe(d,i->a);
+    i->srv = i->txt = i->a = 0;
+}
+void _b_done(mdnsd d, struct mdnsdb_struct *b)
+{ // stop following everything, the memory waits if one of its callbacks is still running
+    struct instance *i;
+    if(b->found == 0) return;
+    b->found = 0;
+    mdnsd_unsubscribe(d,b->ptr);
+    b->ptr = 0;
+    for(i = b->list; i != 0; i = i->next) _i_done(d,i);
+    if(b->busy == 0) _b_free(d,b);
+}
+int _b_exit(struct mdnsdb_struct *b)
+{ // leaving one of its callbacks
+    if(--b->busy == 0 && b->found == 0) _b_free(b->d,b);
+    return 0;
+}
+mdnsds _b_sub(struct mdnsdb_struct *b, char *host, int type, int (*answer)(mdnsda, void *), void *arg)
+{ // subscribe for b, unless what was cached already stopped it
+    mdnsds s = mdnsd_subscribe(b->d,host,type,answer,arg);
+    if(b->found != 0) return s;
+    mdnsd_unsubscribe(b->d,s);
+    return 0;
+}
+void _i_check(struct instance *i, int changed)
+{ // tell if it's resolved now, or changed, or isn't resolved anymore
+    struct mdnsdb_struct *b = i->b;
+    int event;
+    if(b->found == 0) return;
+    if(i->have == 3 && i->i.ip != 0) event = i->resolved ? MDNSD_CHANGED : MDNSD_RESOLVED;
+    else if(i->resolved) event = MDNSD_GONE;
+    else return;
+    if(event == MDNSD_CHANGED && !changed) return;
+    i->resolved = event != MDNSD_GONE;
+    if(b->found(&i->i,event,b->arg) == -1) _b_done(b->d,b);
+}
+int _i_a(mdnsda a, void *arg)
+{ // the host's address, any one of them will do
+    struct instance *i = (struct instance *)arg;
+    struct mdnsdb_struct *b = i->b;
+    mdnsda cur = 0;
+    if(b->found == 0) return -1;
+    b->busy++;
+    if(a->ttl == 0 && a->ip == i->i.ip)
+    { // maybe it has another
+        i->i.ip = 0;
+        while((cur = mdnsd_list(b->d,i->i.host,QTYPE_A,cur)) != 0)
+            if(cur->ttl != 0 && cur->ip != a->ip) i->i.ip = cur->ip;
+        _i_check(i,1);
+    }else if(a->ttl != 0 && i->i.ip == 0){
+        i->i.ip = a->ip;
+        _i_check(i,1);
+    }
+    return _b_exit(b);
+}
+int _i_srv(mdnsda a, void *arg)
+{ // where it is, following the host on to its address
+    struct instance *i = (struct instance *)arg;
+    struct mdnsdb_struct *b = i->b;
+    if(b->found == 0) return -1;
+    b->busy++;
+    if(a->ttl == 0)
+    { // only if it's the one we have
+        if((i->have & 1) && a->rdname == i->i.host && a->srv.port == i->i.port)
+        {
+            i->have &= ~1;
+            _i_check(i,1);
+        }
+        return _b_exit(b);
+    }
+    i->have |= 1;
+    i->i.priority = a->srv.priority;
+    i->i.weight = a->srv.weight;
+    i->i.port = a->srv.port;
+    if(a->rdname != i->i.host)
+    { // a new host, its address may well be cached too
+        mdnsd_unsubscribe(b->d,i->a);
+        _atom_free(b->d,i->i.host);
+        i->i.host = _atom_ref(a->rdname);
+        i->i.ip = 0;
+        i->a = _b_sub(b,i->i.host,QTYPE_A,_i_a,i);
+    }
+    _i_check(i,1);
+    return _b_exit(b);
+}
+int _i_txt(mdnsda a, void *arg)
+{
+    struct instance *i = (struct instance *)arg;
+    struct mdnsdb_struct *b = i->b;
+    if(b->found == 0) return -1;
+    b->busy++;
+    if(a->ttl == 0)
+    {
+        if((i->have & 2) && a->rdlen == i->i.txtlen && memcmp(a->rdata,i->i.txt,a->rdlen) == 0)
+        {
+            i->have &= ~2;
+            _i_check(i,1);
+        }
+        return _b_exit(b);
+    }
+    if(a->rdlen > i->txtsize)
+    {
+        i->i.txt = (unsigned char *)_d_grow(b->d,i->i.txt,0,a->rdlen);
+        i->txtsize = a->rdlen;
+    }
+    memcpy(i->i.txt,a->rdata,a->rdlen);
+    i->i.txtlen = a->rdlen;
+    i->have |= 2;
+    _i_check(i,1);
+    return _b_exit(b);
+}
+int _b_ptr(mdnsda a, void *arg)
+{ // an instance came or went
+    struct mdnsdb_struct *b = (struct mdnsdb_struct *)arg;
+    struct instance *i, **ip;
+    if(b->found == 0) return -1;
+    for(ip = &b->list; (i = *ip) != 0 && i->i.name != a->rdname; ip = &i->next);
+    b->busy++;
+    if(a->ttl == 0 && i != 0)
+    { // gone altogether
+        *ip = i->next;
+        _i_done(b->d,i);
+        if(i->resolved && b->found(&i->i,MDNSD_GONE,b->arg) == -1) _b_done(b->d,b);
+        _i_free(b->d,i);
+    }else if(a->ttl != 0 && i == 0){
+        i = (struct instance *)_d_alloc(b->d,sizeof(struct instance));
+        bzero(i,sizeof(struct instance));
+        i->i.name = _atom_ref(a->rdname);
+        i->b = b;
+        i->next = b->list;
+        b->list = i;
+        // both asked in the same packet if they're not cached already
+        i->srv = _b_sub(b,i->i.name,QTYPE_SRV,_i_srv,i);
+        if(i->srv != 0) i->txt = _b_sub(b,i->i.name,QTYPE_TXT,_i_txt,i);
+    }
+    return _b_exit(b);
+}
+mdnsdb mdnsd_browse(mdnsd d, char *service, int (*found)(mdnsdi i, int event, void *arg), void *arg)
+{
+    struct mdnsdb_struct *b;
+    if(!found) return 0;
+    b = (struct mdnsdb_struct *)_d_alloc(d,sizeof(struct mdnsdb_struct));
+    bzero(b,sizeof(struct mdnsdb_struct));
+    b->d = d;
+    b->service = _atom(d,service);
+    b->found = found;
+    b->arg = arg;
+    b->next = d->browses;
+    d->browses = b;
+    b->busy++;
+    b->ptr = _b_sub(b,b->service,QTYPE_PTR,_b_ptr,b);
+    if(b->found == 0)
+    { // found already stopped it
+        _b_exit(b);
+        return 0;
     }
+    b->busy--;
+    return b;
+}
+void mdnsd_browse_done(mdnsd d, mdnsdb b)
+{
+    if(b != 0) _b_done(d,b);
+}
+
+mdnsda mdnsd_list(mdnsd d, char *host, int type, mdnsda last)
+{
+    char *name = _atom_find(d,host);
+    if(name == 0) return 0;
+    return (mdnsda)_c_next(d,(struct cached *)last,name,type);
+}
+
+mdnsda mdnsd_list_type(mdnsd d, int type, mdnsda last)
+{
+    struct cached *c = last ? ((struct cached *)last)->tnext : d->types[type % TYPES];
+    while(c != 0 && c->rr.type != type) c = c->tnext;
+    return (mdnsda)c;
+}
 
-    if(d->checkqlist)
-    { // also check for queries with known answer expiration/retry
-        if((sec = d->checkqlist - d->now.tv_sec) > 0) d->sleep.tv_sec = sec;
-        RET;
+mdnsda mdnsd_list_domain(mdnsd d, char *domain, int type, mdnsda last)
+{
+    struct atom *top, *a;
+    struct cached *c;
+    char *name = _atom_find(d,domain);
+    if(name == 0) return 0;
+    top = ATOM(name);
+    a = last ? ATOM(last->name) : top;
+    c = last ? ((struct cached *)last)->onext : top->owned;
+    for(;;)
+    {
+        for(; c != 0; c = c->onext)
+            if(type == 255 || c->rr.type == type) return (mdnsda)c;
+        // depth first, down, or else across (going back up as far as it takes)
+        if(a->kids) a = a->kids;
+        else {
+            for(; a != top && a->knext == 0; a = a->up);
+            if(a == top) return 0;
+            a = a->knext;
+        }
+        c = a->owned;
+    }
+}
+mdnsdw mdnsd_watch(mdnsd d, char *domain, int type, int (*answer)(mdnsda a, void *arg), void *arg)
+{
+    struct mdnsdw_struct *w;
+    mdnsda cur = 0;
+    if(!answer) return 0;
+    w = (struct mdnsdw_struct *)_d_alloc(d,sizeof(struct mdnsdw_struct));
+    bzero(w,sizeof(struct mdnsdw_struct));
+    w->domain = _atom(d,domain);
+    w->type = type;
+    w->answer = answer;
+    w->arg = arg;
+    w->next = ATOM(w->domain)->watches;
+    ATOM(w->domain)->watches = w;
+    w->all = d->watches;
+    d->watches = w;
+    d->wbusy++;
+    while(w->answer && (cur = mdnsd_list_domain(d,domain,type,cur)) != 0)
+        if(cur->ttl > d->now.tv_sec && answer(cur,arg) == -1) _w_drop(d,w);
+    if(w->answer == 0) w = 0;
+    _w_exit(d);
+    return w;
+}
+void mdnsd_unwatch(mdnsd d, mdnsdw w)
+{
+    if(w != 0 && w->answer != 0) _w_drop(d,w);
+}
+mdnsdq mdnsd_resolve(mdnsd d, char *host, int type, int msec, void (*done)(mdnsda a, void *arg), void *arg)
+{
+    struct mdnsdq_struct *v, **vp;
+    char *name;
+    if(!done) return 0;
+    gettimeofday(&d->now,0);
+    if((name = _atom_find(d,host)) != 0 && _n_find(d,name,type) != 0)
+    { // missed just now
+        done(0,arg);
+        return 0;
+    }
+    v = (struct mdnsdq_struct *)_d_alloc(d,sizeof(struct mdnsdq_struct));
+    bzero(v,sizeof(struct mdnsdq_struct));
+    v->d = d;
+    v->name = _atom(d,host);
+    v->type = type;
+    v->done = done;
+    v->arg = arg;
+    v->deadline = d->now;
+    v->deadline.tv_sec += msec / 1000;
+    if((v->deadline.tv_usec += (msec % 1000) * 1000) >= 1000000)
+    {
+        v->deadline.tv_sec++;
+        v->deadline.tv_usec -= 1000000;
     }
+    for(vp = &d->resolves; *vp != 0 && !timercmp(&v->deadline,&(*vp)->deadline,<); vp = &(*vp)->next);
+    v->next = *vp;
+    *vp = v;
+    // anything cached already finishes it right away, an NSEC first, otherwise it's asked
+    v->busy = 1;
+    v->nsec = mdnsd_watch(d,v->name,QTYPE_NSEC,_v_nsec,v);
+    if(v->done) v->s = mdnsd_subscribe(d,v->name,type,_v_answer,v);
+    v->busy = 0;
+    if(v->done) return v;
+    mdnsd_unwatch(d,v->nsec); // if it was done before they were even returned
+    mdnsd_unsubscribe(d,v->s);
+    _atom_free(d,v->name);
+    _d_free(d,v);
+    return 0;
+}
+void mdnsd_resolve_cancel(mdnsd d, mdnsdq v)
+{
+    if(v != 0 && v->done != 0) _v_end(v);
+}
+mdnsda mdnsd_list_target(mdnsd d, char *target, int type, mdnsda last)
+{
+    struct cached *c;
+    char *name;
+    if(last) c = ((struct cached *)last)->rnext;
+    else if((name = _atom_find(d,target)) != 0) c = ATOM(name)->targets;
+    else return 0;
+    while(c != 0 && type != 255 && c->rr.type != type) c = c->rnext;
+    return (mdnsda)c;
+}
 
-    // last resort, next gc expiration
-    if((sec = d->expireall - d->now.tv_sec) > 0) d->sleep.tv_sec = sec;
-    RET;
+int mdnsd_lookup(mdnsd d, char *host, int type, int (*answer)(mdnsda a, void *arg), void *arg)
+{
+    struct atom *a, **atoms;
+    struct cached *c;
+    struct timeval now;
+    unsigned long int hash, seq;
+    int slot, size, count = 0;
+
+    gettimeofday(&now,0);
+    hash = name_hash(host);
+    slot = _e_enter(d);
+    do { // the atom, again if the table was regrown underneath
+        while((seq = __atomic_load_n(&d->aseq, __ATOMIC_ACQUIRE)) & 1);
+        size = __atomic_load_n(&d->atomsize, __ATOMIC_ACQUIRE);
+        atoms = __atomic_load_n(&d->atoms, __ATOMIC_ACQUIRE);
+        for(a = __atomic_load_n(&atoms[hash & (size - 1)], __ATOMIC_ACQUIRE); a != 0; a = __atomic_load_n(&a->next, __ATOMIC_ACQUIRE))
+            if(a->hash == hash && name_same(a->name,host)) break;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while(__atomic_load_n(&d->aseq, __ATOMIC_RELAXED) != seq);
+    if(a != 0)
+        for(c = __atomic_load_n(&a->owned, __ATOMIC_ACQUIRE); c != 0; c = __atomic_load_n(&c->onext, __ATOMIC_ACQUIRE))
+        {
+            if((type != 255 && c->rr.type != type) || __atomic_load_n(&c->rr.ttl, __ATOMIC_RELAXED) <= now.tv_sec) continue;
+            count++;
+            if(answer(&c->rr,arg) == -1) break;
+        }
+    _e_exit(d,slot);
+    return count;
 }
 
-void mdnsd_query(mdnsd d, char *host, int type, int (*answer)(mdnsda a, void *arg), void *arg)
+int mdnsd_cache_size(mdnsd d, unsigned long int *bytes)
 {
-    struct query *q;
-    struct cached *cur = 0;
-    int i = _namehash(host) % SPRIME;
-    if(!(q = _q_next(d,0,host,type)))
-    {
-        if(!answer) return;
-        q = (struct query *)malloc(sizeof(struct query));
-        bzero(q,sizeof(struct query));
-        q->name = strdup(host);
-        q->type = type;
-        q->next = d->queries[i];
-        q->list = d->qlist;
-        d->qlist = d->queries[i] = q;
-        while(cur = _c_next(d,cur,q->name,q->type))
-            cur->q = q; // any cached entries should be associated
-        _q_reset(d,q);
-        q->nexttry = d->checkqlist = d->now.tv_sec; // new questin, immediately send out
-    }
-    if(!answer)
-    { // no answer means we don't care anymore
-        _q_done(d,q);
-        return;
+    if(bytes) *bytes = d->cbytes;
+    return d->heap[0].count + d->heap[1].count;
+}
+
+/* snapshot layout, everything in network order and each entry padded out to 4 bytes so it can be read straight out of an mmap
+    header: magic, version, count (32 bits each)
+    entry: size of the whole entry (32), expires (64, as two 32), type, rdlen (16), ip (32), priority, weight, port, namelen, rdnamelen, 0 (16)
+           then name, rdname, rdata (no terminators) and padding
+*/
+int mdnsd_snapshot_save(mdnsd d, char *file)
+{
+    unsigned char head[SNAPENTRY], *buf, zero[4] = {0,0,0,0};
+    struct cached *c;
+    FILE *f;
+    char *tmp;
+    int i, j, count = 0, nlen, rlen, size, ok;
+
+    // written next to it first and then renamed over it, so the old one stays whole if this doesn't finish
+    tmp = (char *)_d_alloc(d,strlen(file) + 5);
+    sprintf(tmp,"%s.tmp",file);
+    if((f = fopen(tmp,"w")) == 0)
+    {
+        _d_free(d,tmp);
+        return -1;
+    }
+    buf = head;
+    long2net(SNAPSHOT,&buf);
+    long2net(SNAPVERSION,&buf);
+    long2net(d->heap[0].count + d->heap[1].count,&buf);
+    ok = fwrite(head,1,SNAPHEAD,f) == SNAPHEAD;
+    for(j = 0; ok && j < 2; j++)
+        for(i = 0; ok && i < d->heap[j].count; i++)
+        {
+            c = d->heap[j].e[i];
+            nlen = strlen(c->rr.name);
+            rlen = c->rr.rdname ? strlen(c->rr.rdname) : 0;
+            size = (SNAPENTRY + nlen + rlen + c->rr.rdlen + 3) & ~3;
+            buf = head;
+            long2net(size,&buf);
+            long2net((unsigned long int)(((unsigned long long int)c->rr.ttl) >> 32),&buf);
+            long2net(c->rr.ttl & 0xffffffffUL,&buf);
+            short2net(c->rr.type,&buf);
+            short2net(c->rr.rdlen,&buf);
+            long2net(c->rr.ip,&buf);
+            short2net(c->rr.srv.priority,&buf);
+            short2net(c->rr.srv.weight,&buf);
+            short2net(c->rr.srv.port,&buf);
+            short2net(nlen,&buf);
+            short2net(rlen,&buf);
+            short2net(0,&buf);
+            ok = fwrite(head,1,SNAPENTRY,f) == SNAPENTRY && fwrite(c->rr.name,1,nlen,f) == nlen;
+            if(ok && rlen) ok = fwrite(c->rr.rdname,1,rlen,f) == rlen;
+            if(ok && c->rr.rdlen) ok = fwrite(c->rr.rdata,1,c->rr.rdlen,f) == c->rr.rdlen;
+            nlen = size - (SNAPENTRY + nlen + rlen + c->rr.rdlen);
+            if(ok && nlen) ok = fwrite(zero,1,nlen,f) == nlen;
+            count++;
+        }
+    if(fclose(f) != 0) ok = 0;
+    if(!ok || rename(tmp,file) != 0)
+    {
+        unlink(tmp);
+        count = -1;
     }
-    q->answer = answer;
-    q->arg = arg;
+    _d_free(d,tmp);
+    return count;
 }
 
-mdnsda mdnsd_list(mdnsd d, char *host, int type, mdnsda last)
+int mdnsd_snapshot_load(mdnsd d, char *file)
 {
-    return (mdnsda)_c_next(d,(struct cached *)last,host,type);
+    unsigned char *map, *buf, *end, *e;
+    char name[256], rdname[256], *n, *rn;
+    struct stat st;
+    struct resource r;
+    unsigned long int hi, ttl, rhash, ip;
+    unsigned short int priority, weight, port;
+    int fd, size, nlen, rlen, left, count = 0;
+
+    if((fd = open(file,O_RDONLY)) < 0) return -1;
+    if(fstat(fd,&st) != 0 || st.st_size < SNAPHEAD || (map = (unsigned char *)mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0)) == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    buf = map;
+    end = map + st.st_size;
+    if(net2long(&buf) != SNAPSHOT || net2long(&buf) != SNAPVERSION)
+    {
+        munmap(map,st.st_size);
+        return -1;
+    }
+    gettimeofday(&d->now,0);
+    for(left = net2long(&buf); left > 0 && end - buf >= SNAPENTRY; left--)
+    { // anything cut short or that doesn't add up ends it there
+        e = buf;
+        bzero(&r,sizeof(struct resource));
+        size = net2long(&e);
+        if(size < SNAPENTRY || (size & 3) || size > end - buf) break;
+        hi = net2long(&e);
+        ttl = (unsigned long int)((unsigned long long int)hi << 32 | net2long(&e));
+        r.type = net2short(&e);
+        r.rdlength = net2short(&e);
+        ip = net2long(&e);
+        priority = net2short(&e);
+        weight = net2short(&e);
+        port = net2short(&e);
+        nlen = net2short(&e);
+        rlen = net2short(&e);
+        if(nlen == 0 || nlen > 255 || rlen > 255 || SNAPENTRY + nlen + rlen + r.rdlength > size) break;
+        memcpy(name,buf + SNAPENTRY,nlen);
+        name[nlen] = 0;
+        memcpy(rdname,buf + SNAPENTRY + nlen,rlen);
+        rdname[rlen] = 0;
+        r.rdata = buf + SNAPENTRY + nlen + rlen;
+        buf += size;
+        if(ttl <= d->now.tv_sec) continue; // expired while it was saved
+        r.name = name;
+        r.class = d->class;
+        switch(r.type)
+        { // known is a union, only what the type has
+        case QTYPE_A:
+            r.known.a.ip = ip;
+            break;
+        case QTYPE_NS:
+        case QTYPE_CNAME:
+        case QTYPE_PTR:
+            r.known.ns.name = rlen ? rdname : 0;
+            break;
+        case QTYPE_SRV:
+            r.known.srv.priority = priority;
+            r.known.srv.weight = weight;
+            r.known.srv.port = port;
+            r.known.srv.name = rlen ? rdname : 0;
+            break;
+        }
+        if(!_valid(d,&r)) continue; // same as if it came in off the network
+        n = _atom(d,name);
+        rn = _atom(d,_rr_rdname(&r));
+        rhash = _rhash(&r,rn);
+        if(_c_find(d,&r,n,rn,rhash) == 0)
+        {
+            _c_new(d,&r,n,rn,rhash,ttl);
+            count++;
+        }
+        _atom_free(d,n);
+        _atom_free(d,rn);
+    }
+    munmap(map,st.st_size);
+    return count;
 }
 
 mdnsdr mdnsd_shared(mdnsd d, char *host, int type, long int ttl)
 {
-    int i = _namehash(host) % SPRIME;
+    int i;
     mdnsdr r;
-    r = (mdnsdr)malloc(sizeof(struct mdnsdr_struct));
-    bzero(r,sizeof(struct mdnsdr_struct));
-    r->rr.name = strdup(host);
+    r = (mdnsdr)_p_get(d,&d->precord);
+    r->rr.name = _atom(d,host);
+    r->wname = _wname(d,host); // as given, the atom might be spelled in another case
+    i = ATOM(r->rr.name)->hash % SPRIME;
     r->rr.type = type;
     r->rr.ttl = ttl;
     r->next = d->published[i];
@@ -714,6 +2886,7 @@ mdnsdr mdnsd_unique(mdnsd d, char *host, int type, long int ttl, void (*conflict
 void mdnsd_done(mdnsd d, mdnsdr r)
 {
     mdnsdr cur;
+    _rc_drop(d,r);
     if(r->unique && r->unique < 5)
     { // probing yet, zap from that list first!
         if(d->probing == r) d->probing = r->list;
@@ -730,8 +2903,8 @@ void mdnsd_done(mdnsd d, mdnsdr r)
 
 void mdnsd_set_raw(mdnsd d, mdnsdr r, char *data, int len)
 {
-    free(r->rr.rdata);
-    r->rr.rdata = (unsigned char *)malloc(len);
+    _rdata_free(d,r->small,r->rr.rdata);
+    r->rr.rdata = _rdata(d,r->small,len);
     memcpy(r->rr.rdata,data,len);
     r->rr.rdlen = len;
     _r_publish(d,r);
@@ -739,8 +2912,11 @@ void mdnsd_set_raw(mdnsd d, mdnsdr r, char *data, int len)
 
 void mdnsd_set_host(mdnsd d, mdnsdr r, char *name)
 {
-    free(r->rr.rdname);
-    r->rr.rdname = strdup(name);
+    char *rdname = _atom(d,name);
+    _atom_free(d,r->rr.rdname);
+    _d_free(d,r->wrdname);
+    r->rr.rdname = rdname;
+    r->wrdname = _wname(d,name);
     _r_publish(d,r);
 }
 
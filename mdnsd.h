@@ -5,6 +5,10 @@
 
 typedef struct mdnsd_struct *mdnsd; // main daemon data
 typedef struct mdnsdr_struct *mdnsdr; // record entry
+typedef struct mdnsds_struct *mdnsds; // query subscription
+typedef struct mdnsdb_struct *mdnsdb; // service browse
+typedef struct mdnsdw_struct *mdnsdw; // domain watch
+typedef struct mdnsdq_struct *mdnsdq; // one-shot resolve
 // answer data
 typedef struct mdnsda_struct
 {
@@ -17,20 +21,52 @@ typedef struct mdnsda_struct
     unsigned char *rdname; // NS/CNAME/PTR/SRV
     struct { unsigned short int priority, weight, port; } srv; // SRV
 } *mdnsda;
+// a browsed service instance, as much of it as is known
+typedef struct mdnsdi_struct
+{
+    unsigned char *name; // the instance, what the PTR points to
+    unsigned char *host; // SRV
+    unsigned short int priority, weight, port; // SRV
+    unsigned long int ip; // A of host
+    unsigned char *txt; // TXT rdata (see sdtxt.h)
+    int txtlen;
+} *mdnsdi;
+// what happened to it
+#define MDNSD_GONE 0
+#define MDNSD_RESOLVED 1
+#define MDNSD_CHANGED 2
 
 ///////////
 // Global functions
 //
 // create a new mdns daemon for the given class of names (usually 1) and maximum frame size
+//   frame is the most any packet it builds will be, up to MAX_PACKET_LEN (9000, jumbo frames), longer known answer lists go out in TC continuations
 mdnsd mdnsd_new(int class, int frame);
 //
+// settings for mdnsd_new_config(), any left 0 get the default
+struct mdnsd_config
+{
+    int class; // class of names, 1
+    int frame; // maximum frame size, MAX_PACKET_LEN
+    int cache; // how many distinct name/types the cache has room for before it first grows (it rehashes a bit at a time), 1024
+    int cachemax; // most entries the cache holds, the soonest to expire that no query wants are evicted first, no limit
+    unsigned long int cachebytes; // most memory the cache uses (as mdnsd_cache_size() counts it), evicting the same way, no limit
+    void *(*alloc)(void *arg, unsigned long int size); // where all of its memory comes from (set both or neither), malloc()/free()
+    void (*free)(void *arg, void *ptr);
+    void *arg; // passed to both
+    int negative; // how long (msec) a resolve that timed out is remembered, resolving it again meanwhile fails right away, 1000 (-1 not at all)
+};
+//
+// same as mdnsd_new() with more settings
+mdnsd mdnsd_new_config(struct mdnsd_config *config);
+//
 // gracefully shutdown the daemon, use mdnsd_out() to get the last packets
 void mdnsd_shutdown(mdnsd d);
 //
 // flush all cached records (network/interface changed)
 void mdnsd_flush(mdnsd d);
 //
-// free given mdnsd (should have used mdnsd_shutdown() first!)
+// free given mdnsd and everything it still has (should have used mdnsd_shutdown() first!)
 void mdnsd_free(mdnsd d);
 //
 ///////////
@@ -39,9 +75,15 @@ void mdnsd_free(mdnsd d);
 // I/O functions
 //
 // incoming message from host (to be cached/processed)
+//   ip and port are in network byte order straight from the sockaddr_in, the same as mdnsd_out() gives them
 void mdnsd_in(mdnsd d, struct message *m, unsigned long int ip, unsigned short int port);
 //
+// same as mdnsd_in() but straight from the len bytes received into packet (a MAX_PACKET_LEN buffer)
+//   uses a message_view(), so packets with nothing for us are dropped without being copied or fully decoded
+void mdnsd_in_packet(mdnsd d, unsigned char *packet, int len, unsigned long int ip, unsigned short int port);
+//
 // outgoing messge to be delivered to host, returns >0 if one was returned and m/ip/port set
+//   m is only reset each time, so it must have been zero'd once (or come from message_wire())
 int mdnsd_out(mdnsd d, struct message *m, unsigned long int *ip, unsigned short int *port);
 //
 // returns the max wait-time until mdnsd_out() needs to be called again
@@ -55,12 +97,69 @@ struct timeval *mdnsd_sleep(mdnsd d);
 // register a new query
 //   answer(record, arg) is called whenever one is found/changes/expires (immediate or anytime after, mdnsda valid until ->ttl==0)
 //   either answer returns -1, or another mdnsd_query with a NULL answer will remove/unregister this query
+//   it's one subscription (see below) of its own, any others to the same host/type keep going without it
 void mdnsd_query(mdnsd d, char *host, int type, int (*answer)(mdnsda a, void *arg), void *arg);
 //
+// subscribe to a query, every subscription to the same host/type shares one query on the network
+//   answer is called the same as mdnsd_query's, for whatever's cached right away too, returning -1 unsubscribes it
+//   returns the handle (NULL if answer already unsubscribed it), the query goes when its last subscription does
+mdnsds mdnsd_subscribe(mdnsd d, char *host, int type, int (*answer)(mdnsda a, void *arg), void *arg);
+//
+// unsubscribe, only this one, s is invalid after
+void mdnsd_unsubscribe(mdnsd d, mdnsds s);
+//
+// browse for a service type (like "_http._tcp.local."), following each PTR to its SRV and TXT and on to the A all inside
+//   found(i, event, arg) is called with MDNSD_RESOLVED once an instance has all of them, MDNSD_CHANGED whenever any change after,
+//   and MDNSD_GONE when it's lost one (it's resolved again if it comes back) or is gone altogether, i is valid only during the call
+//   cached answers (usually the additional records that came with the PTR) are used right away, whatever's missing is asked together
+//   returns the handle, found returning -1 or mdnsd_browse_done() stops it
+mdnsdb mdnsd_browse(mdnsd d, char *service, int (*found)(mdnsdi i, int event, void *arg), void *arg);
+void mdnsd_browse_done(mdnsd d, mdnsdb b);
+//
 // returns the first (if last == NULL) or next answer after last from the cache
 //   mdnsda only valid until an I/O function is called
 mdnsda mdnsd_list(mdnsd d, char *host, int type, mdnsda last);
 //
+// same, but every cached answer of a type whatever its name (all the PTRs, for a whole directory)
+mdnsda mdnsd_list_type(mdnsd d, int type, mdnsda last);
+//
+// same, but the answers whose rdname is target (NS/CNAME/PTR/SRV, 255 for any), say every SRV on a host
+mdnsda mdnsd_list_target(mdnsd d, char *target, int type, mdnsda last);
+//
+// same, but every cached answer in a domain, the name itself and all the ones under it (255 for any type), say "_tcp.local."
+mdnsda mdnsd_list_domain(mdnsd d, char *domain, int type, mdnsda last);
+//
+// watch the cache in a domain the same way (255 for any type), nothing is asked on the network (the queries keep it fresh)
+//   answer(a, arg) is called like a query's, for whatever's cached right away too, then whenever an entry is added or expires
+//   returns the handle (NULL if answer already stopped it), answer returning -1 or mdnsd_unwatch() stops it
+mdnsdw mdnsd_watch(mdnsd d, char *domain, int type, int (*answer)(mdnsda a, void *arg), void *arg);
+void mdnsd_unwatch(mdnsd d, mdnsdw w);
+//
+// resolve host/type just once, done(a, arg) is called exactly once, with the first answer (valid only during the call),
+//   or with NULL when there's none within msec or a responder's NSEC says there's no such record, right away if that's known already
+//   one that timed out fails right away for a while after (see mdnsd_config's negative), so misses don't keep asking
+//   returns the handle to cancel it with (NULL if done was called already), it's freed once done is
+mdnsdq mdnsd_resolve(mdnsd d, char *host, int type, int msec, void (*done)(mdnsda a, void *arg), void *arg);
+//
+// cancel a resolve, done isn't called
+void mdnsd_resolve_cancel(mdnsd d, mdnsdq v);
+//
+// look up cached answers (255 for any type) from any thread, even while the one doing everything else is in mdnsd_in()/mdnsd_out()
+//   it never blocks that thread, answer(a, arg) is called for each (a is valid only during the call, its ttl may change meanwhile)
+//   returns how many were given, answer returning -1 stops it (the only mdnsd_* function that's safe from other threads)
+int mdnsd_lookup(mdnsd d, char *host, int type, int (*answer)(mdnsda a, void *arg), void *arg);
+//
+// how many entries are cached, and how many bytes they use if bytes isn't NULL (each counts its names in full, even shared)
+int mdnsd_cache_size(mdnsd d, unsigned long int *bytes);
+//
+// write the cache to a file (with when each entry expires), returns how many entries or -1 if it couldn't
+//   it goes to file.tmp first and is renamed into place, so a save that doesn't finish leaves the last one as it was
+int mdnsd_snapshot_save(mdnsd d, char *file);
+//
+// load a saved cache back, say at startup, returns how many entries or -1 if it couldn't
+//   whatever has expired since is skipped, the rest is listed/answered right away and refreshed as usual once queried
+int mdnsd_snapshot_load(mdnsd d, char *file);
+//
 ///////////
 
 ///////////
@@ -106,6 +106,7 @@ int main(int argc, char *argv[])
     mdnsd_set_raw(d,r,packet,len);
     free(packet);
 
+    bzero(&m,sizeof(struct message));
     while(1)
     {
         tv = mdnsd_sleep(d);
@@ -120,11 +121,7 @@ int main(int argc, char *argv[])
         if(FD_ISSET(s,&fds))
         {
             while((bsize = recvfrom(s,buf,MAX_PACKET_LEN,0,(struct sockaddr*)&from,&ssize)) > 0)
-            {
-                bzero(&m,sizeof(struct message));
-                message_parse(&m,buf);
-                mdnsd_in(d,&m,(unsigned long int)from.sin_addr.s_addr,from.sin_port);
-            }
+                mdnsd_in_packet(d,buf,bsize,(unsigned long int)from.sin_addr.s_addr,from.sin_port);
             if(bsize < 0 && errno != EAGAIN) { printf("can't read from socket %d: %s\n",errno,strerror(errno)); return 1; }
         }
         while(mdnsd_out(d,&m,&ip,&port))
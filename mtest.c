@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "mdnsd.h"
+
+// regression checks, each returns how many things were wrong, ports are given as they come off the socket (network order)
+
+static struct message m;
+static unsigned char buf[MAX_PACKET_LEN];
+
+// hand the built message m to d as if it came from ip
+void deliver(mdnsd d, unsigned long int ip)
+{
+    int len = message_packet_len(&m);
+    memcpy(buf,message_packet(&m),len);
+    bzero(buf + len,MAX_PACKET_LEN - len);
+    mdnsd_in_packet(d,buf,len,ip,htons(5353));
+}
+
+// a TC query's known answers continue in the next packet from the same host, the answer waits for them
+int tc_known()
+{
+    mdnsd d = mdnsd_new(1,1400);
+    char *names[3] = {"a._svc._tcp.local.", "b._svc._tcp.local.", "c._svc._tcp.local."};
+    unsigned long int ip;
+    unsigned short int port;
+    struct message out;
+    struct mview v;
+    struct resource rr;
+    unsigned char nb[512];
+    int i, n, bad = 0, got = 0;
+
+    for(i = 0; i < 3; i++) mdnsd_set_host(d,mdnsd_shared(d,"_svc._tcp.local.",QTYPE_PTR,120),names[i]);
+    bzero(&out,sizeof(out));
+    for(n = 0; n < 70; n++, usleep(100000)) while(mdnsd_out(d,&out,&ip,&port)); // all their announcements, they're only answered after
+
+    bzero(&m,sizeof(m));
+    m.header.tc = 1;
+    message_qd(&m,"_svc._tcp.local.",QTYPE_PTR,1);
+    message_an(&m,"_svc._tcp.local.",QTYPE_PTR,1,120);
+    message_rdata_name(&m,names[0]);
+    deliver(d,inet_addr("10.0.0.2"));
+    bzero(&m,sizeof(m));
+    message_an(&m,"_svc._tcp.local.",QTYPE_PTR,1,120);
+    message_rdata_name(&m,names[1]);
+    deliver(d,inet_addr("10.0.0.2"));
+
+    for(n = 0; n < 60; n++, usleep(20000))
+        while(mdnsd_out(d,&out,&ip,&port))
+        {
+            message_view(&v,message_packet(&out),message_packet_len(&out));
+            for(i = 0; i < v.ancount; i++)
+            {
+                mview_rr(&v,i,&rr,nb);
+                if(strcmp((char *)rr.known.ptr.name,names[2]) == 0) got++;
+                else bad++; // one they said they know
+            }
+        }
+    if(got != 1) bad++;
+    if(bad) printf("tc_known: answered %d known, %d unknown\n",bad,got);
+    mdnsd_free(d);
+    return bad;
+}
+
+// how many additional records went with the answer to a PTR question in the next 1.2 sec, -1 if none went
+int ptr_extra(mdnsd d)
+{
+    unsigned long int ip;
+    unsigned short int port;
+    struct message out;
+    struct mview v;
+    struct resource rr;
+    unsigned char nb[512];
+    int i, n, ar = -1;
+
+    bzero(&out,sizeof(out));
+    for(n = 0; n < 60; n++, usleep(20000))
+        while(mdnsd_out(d,&out,&ip,&port))
+        {
+            message_view(&v,message_packet(&out),message_packet_len(&out));
+            for(i = 0; i < v.ancount; i++)
+                if(mview_rr(&v,i,&rr,nb) && rr.type == QTYPE_PTR) ar = v.arcount;
+        }
+    return ar;
+}
+
+// one host listing the SRV as known doesn't keep it (or the A with it) out of the answer to another's PTR question
+int extra_known()
+{
+    mdnsd d = mdnsd_new(1,1400);
+    unsigned long int ip;
+    unsigned short int port;
+    struct message out;
+    int i, n, ar, bad = 0;
+
+    mdnsd_set_host(d,mdnsd_shared(d,"_svc._tcp.local.",QTYPE_PTR,120),"x._svc._tcp.local.");
+    mdnsd_set_srv(d,mdnsd_shared(d,"x._svc._tcp.local.",QTYPE_SRV,120),0,0,80,"x.local.");
+    mdnsd_set_raw(d,mdnsd_shared(d,"x._svc._tcp.local.",QTYPE_TXT,120),"\003a=b",4);
+    mdnsd_set_ip(d,mdnsd_shared(d,"x.local.",QTYPE_A,120),inet_addr("10.0.0.1"));
+    bzero(&out,sizeof(out));
+    for(n = 0; n < 70; n++, usleep(100000)) while(mdnsd_out(d,&out,&ip,&port));
+
+    for(n = 0; n < 3; n++)
+    { // from the response cache, from it again, then the long way (a known answer keeps it out of the cache)
+        bzero(&m,sizeof(m));
+        message_qd(&m,"x._svc._tcp.local.",QTYPE_SRV,1);
+        message_an(&m,"x._svc._tcp.local.",QTYPE_SRV,1,120);
+        message_rdata_srv(&m,0,0,80,"x.local.");
+        deliver(d,inet_addr("10.0.0.2"));
+        for(i = 0; i < 15; i++, usleep(20000)) while(mdnsd_out(d,&out,&ip,&port)); // its answer, on its own
+        bzero(&m,sizeof(m));
+        message_qd(&m,"_svc._tcp.local.",QTYPE_PTR,1);
+        if(n == 2)
+        {
+            message_an(&m,"_svc._tcp.local.",QTYPE_PTR,1,120);
+            message_rdata_name(&m,"y._svc._tcp.local.");
+        }
+        deliver(d,inet_addr("10.0.0.3"));
+        if((ar = ptr_extra(d)) == 3) continue;
+        printf("extra_known: %d additional records with the PTR (try %d)\n",ar,n);
+        bad++;
+    }
+    mdnsd_free(d);
+    return bad;
+}
+
+// publishing what goes with a cached answer drops it, the next answer carries the new additional records
+int extra_stale()
+{
+    mdnsd d = mdnsd_new(1,1400);
+    unsigned long int ip;
+    unsigned short int port;
+    struct message out;
+    int n, ar, bad = 0;
+
+    mdnsd_set_host(d,mdnsd_shared(d,"_svc._tcp.local.",QTYPE_PTR,120),"x._svc._tcp.local.");
+    mdnsd_set_ip(d,mdnsd_shared(d,"x.local.",QTYPE_A,120),inet_addr("10.0.0.1"));
+    bzero(&out,sizeof(out));
+    for(n = 0; n < 70; n++, usleep(100000)) while(mdnsd_out(d,&out,&ip,&port));
+
+    for(n = 0; n < 2; n++)
+    { // cached without the SRV, then again once it's there
+        if(n == 1) mdnsd_set_srv(d,mdnsd_shared(d,"x._svc._tcp.local.",QTYPE_SRV,120),0,0,80,"x.local.");
+        bzero(&m,sizeof(m));
+        message_qd(&m,"_svc._tcp.local.",QTYPE_PTR,1);
+        deliver(d,inet_addr("10.0.0.3"));
+        if((ar = ptr_extra(d)) == n * 2) continue;
+        printf("extra_stale: %d additional records with the PTR (try %d)\n",ar,n);
+        bad++;
+    }
+    mdnsd_free(d);
+    return bad;
+}
+
+static mdnsds sub;
+static int heard;
+int sub_answer(mdnsda a, void *arg) { heard++; return 0; }
+int watch_answer(mdnsda a, void *arg)
+{ // the goodbye unsubscribes the last one of its query
+    if(a->ttl == 0 && sub) { mdnsd_unsubscribe((mdnsd)arg,sub); sub = 0; }
+    return 0;
+}
+
+// a watch unsubscribing the last subscriber as a record goes leaves the query for after (run under -fsanitize=address to see it)
+int watch_unsub()
+{
+    mdnsd d = mdnsd_new(1,1400);
+    int bad = 0;
+
+    sub = mdnsd_subscribe(d,"x.local.",QTYPE_A,sub_answer,0);
+    mdnsd_watch(d,"local.",QTYPE_A,watch_answer,d);
+    bzero(&m,sizeof(m));
+    m.header.qr = 1;
+    message_an(&m,"x.local.",QTYPE_A,1,120);
+    message_rdata_long(&m,inet_addr("10.0.0.1"));
+    deliver(d,inet_addr("10.0.0.2"));
+    bzero(&m,sizeof(m));
+    m.header.qr = 1;
+    message_an(&m,"x.local.",QTYPE_A,1,0);
+    message_rdata_long(&m,inet_addr("10.0.0.1"));
+    deliver(d,inet_addr("10.0.0.2"));
+    if(sub != 0 || heard != 1) bad++; // it was unsubscribed before hearing the goodbye
+    if(mdnsd_list(d,"x.local.",QTYPE_A,0) != 0) bad++;
+    if(bad) printf("watch_unsub: subscribed %d, heard %d\n",sub != 0,heard);
+    mdnsd_free(d);
+    return bad;
+}
+
+int watch_subscribe(mdnsda a, void *arg)
+{ // subscribes to each host as it shows up
+    if(a->ttl != 0 && sub == 0) sub = mdnsd_subscribe((mdnsd)arg,(char *)a->name,a->type,sub_answer,0);
+    return 0;
+}
+
+// a watch subscribing to the record it's told about hears it once, and its query goes with the subscription
+int watch_sub()
+{
+    mdnsd d = mdnsd_new(1,1400);
+    unsigned long int ip;
+    unsigned short int port;
+    struct message out;
+    struct mview v;
+    int n, asked = 0, bad = 0;
+
+    sub = 0;
+    heard = 0;
+    mdnsd_watch(d,"local.",QTYPE_A,watch_subscribe,d);
+    bzero(&m,sizeof(m));
+    m.header.qr = 1;
+    message_an(&m,"x.local.",QTYPE_A,1,120);
+    message_rdata_long(&m,inet_addr("10.0.0.1"));
+    deliver(d,inet_addr("10.0.0.2"));
+    if(sub == 0 || heard != 1) bad++;
+    if(sub) mdnsd_unsubscribe(d,sub);
+    bzero(&out,sizeof(out));
+    for(n = 0; n < 25; n++, usleep(100000))
+        while(mdnsd_out(d,&out,&ip,&port))
+        {
+            message_view(&v,message_packet(&out),message_packet_len(&out));
+            asked += v.qdcount;
+        }
+    if(asked) bad++; // nobody's asking any more
+    if(bad) printf("watch_sub: heard %d, asked %d after unsubscribing\n",heard,asked);
+    mdnsd_free(d);
+    return bad;
+}
+
+int nothing(mdnsda a, void *arg) { return 0; }
+
+// a question first asked late in a second isn't asked again at the top of the next, they're at least a second apart
+int first_gap()
+{
+    mdnsd d = mdnsd_new(1,1400);
+    unsigned long int ip;
+    unsigned short int port;
+    struct message out;
+    struct timeval now, at[2];
+    int n, asked = 0, bad = 0;
+    long int gap;
+
+    for(gettimeofday(&now,0); now.tv_usec < 950000; gettimeofday(&now,0)) usleep(1000);
+    mdnsd_query(d,"x.local.",QTYPE_A,nothing,0);
+    bzero(&out,sizeof(out));
+    for(n = 0; n < 250 && asked < 2; n++, usleep(10000))
+        while(mdnsd_out(d,&out,&ip,&port))
+            if(out.qdcount && asked < 2) gettimeofday(&at[asked++],0);
+    gap = asked < 2 ? 0 : (at[1].tv_sec - at[0].tv_sec) * 1000 + (at[1].tv_usec - at[0].tv_usec) / 1000;
+    if(gap < 1000) bad++;
+    if(bad) printf("first_gap: asked %d times, %ld msec apart\n",asked,gap);
+    mdnsd_free(d);
+    return bad;
+}
+
+int main(int argc, char *argv[])
+{
+    int bad = 0;
+    bad += tc_known();
+    bad += extra_known();
+    bad += extra_stale();
+    bad += watch_unsub();
+    bad += watch_sub();
+    bad += first_gap();
+    printf(bad ? "FAIL\n" : "ok\n");
+    return bad ? 1 : 0;
+}